@@ -0,0 +1,20 @@
+
+-- asynchronous calls
+CREATE FUNCTION plproxy_call_async (regprocedure)
+RETURNS int4 AS 'plproxy' LANGUAGE C;
+
+CREATE FUNCTION plproxy_call_async (regprocedure, VARIADIC "any")
+RETURNS int4 AS 'plproxy' LANGUAGE C;
+
+CREATE FUNCTION plproxy_wait (int4)
+RETURNS void AS 'plproxy' LANGUAGE C STRICT;
+
+CREATE FUNCTION plproxy_fetch (int4)
+RETURNS SETOF text AS 'plproxy' LANGUAGE C STRICT;
+
+CREATE FUNCTION plproxy_result_bytes (int4)
+RETURNS int8 AS 'plproxy' LANGUAGE C STRICT;
+
+CREATE FUNCTION plproxy_last_result_bytes ()
+RETURNS int8 AS 'plproxy' LANGUAGE C;
+
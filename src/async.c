@@ -0,0 +1,437 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Copyright (c) 2006 Sven Suursoho, Skype Technologies OÜ
+ * Copyright (c) 2007 Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Asynchronous calls of PL/Proxy functions.
+ *
+ * plproxy_call_async() compiles the function, sends the query to
+ * partitions and returns a handle without waiting for results.
+ * plproxy_wait() and plproxy_fetch() then collect the results.
+ *
+ * Calls are tied to the transaction, unfinished ones are dropped
+ * at transaction end.
+ */
+
+#include "plproxy.h"
+
+PG_FUNCTION_INFO_V1(plproxy_call_async);
+PG_FUNCTION_INFO_V1(plproxy_wait);
+PG_FUNCTION_INFO_V1(plproxy_fetch);
+PG_FUNCTION_INFO_V1(plproxy_result_bytes);
+PG_FUNCTION_INFO_V1(plproxy_last_result_bytes);
+
+typedef struct AsyncCall
+{
+	int32		handle;			/* Number given to user */
+	MemoryContext ctx;			/* Context for call state and arguments */
+	ProxyFunction *func;		/* Function being called */
+	ProxyExec  *exec;			/* Execution state */
+	bool		finished;		/* Results have arrived */
+	Oid			out_func;		/* Output function for result */
+	FmgrInfo	flinfo;			/* Fake call info for the function */
+	FunctionCallInfoData fcinfo;
+} AsyncCall;
+
+static AsyncCall *async_calls[PLPROXY_ASYNC_MAX];
+static int32 last_handle = 0;
+static bool xact_callback_registered = false;
+
+/* Release execution and call state */
+static void
+drop_call(AsyncCall *call, bool release_exec)
+{
+	int			i;
+
+	if (call->exec && release_exec)
+		plproxy_exec_release(call->exec);
+
+	for (i = 0; i < PLPROXY_ASYNC_MAX; i++)
+	{
+		if (async_calls[i] == call)
+			async_calls[i] = NULL;
+	}
+
+	MemoryContextDelete(call->ctx);
+}
+
+/*
+ * Drop all calls at transaction end.
+ *
+ * Execution states are released by execute.c then.
+ *
+ * Prepared transaction cannot finish calls later, so like with
+ * temp tables, PREPARE is refused while calls are in progress.
+ */
+static void
+async_xact_callback(XactEvent event, void *arg)
+{
+	int			i;
+
+#if PG_VERSION_NUM >= 90300
+	if (event == XACT_EVENT_PRE_PREPARE)
+	{
+		for (i = 0; i < PLPROXY_ASYNC_MAX; i++)
+		{
+			if (async_calls[i])
+				elog(ERROR, "PL/Proxy: cannot PREPARE a transaction that has asynchronous calls in progress");
+		}
+		return;
+	}
+#endif
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT
+		&& event != XACT_EVENT_PREPARE)
+		return;
+
+	for (i = 0; i < PLPROXY_ASYNC_MAX; i++)
+	{
+		if (async_calls[i])
+			drop_call(async_calls[i], false);
+	}
+}
+
+/* Allocate new call slot */
+static AsyncCall *
+new_call(void)
+{
+	AsyncCall  *call;
+	MemoryContext ctx;
+	int			i;
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(async_xact_callback, NULL);
+		xact_callback_registered = true;
+	}
+
+	for (i = 0; i < PLPROXY_ASYNC_MAX; i++)
+	{
+		if (async_calls[i] == NULL)
+			break;
+	}
+	if (i >= PLPROXY_ASYNC_MAX)
+		elog(ERROR, "PL/Proxy: too many asynchronous calls in progress");
+
+	ctx = AllocSetContextCreate(TopMemoryContext,
+								"PL/Proxy async call context",
+								ALLOCSET_SMALL_MINSIZE,
+								ALLOCSET_SMALL_INITSIZE,
+								ALLOCSET_DEFAULT_MAXSIZE);
+	call = MemoryContextAllocZero(ctx, sizeof(*call));
+	call->ctx = ctx;
+
+	/* handles are not reused, so stale ones are detected */
+	if (++last_handle <= 0)
+		last_handle = 1;
+	call->handle = last_handle;
+
+	async_calls[i] = call;
+	return call;
+}
+
+static AsyncCall *
+find_call(int32 handle)
+{
+	int			i;
+
+	for (i = 0; i < PLPROXY_ASYNC_MAX; i++)
+	{
+		if (async_calls[i] && async_calls[i]->handle == handle)
+			return async_calls[i];
+	}
+	elog(ERROR, "PL/Proxy: unknown asynchronous call handle: %d", handle);
+	return NULL;
+}
+
+/*
+ * Copy argument from caller to call context,
+ * converting via text if the types differ.
+ */
+static Datum
+copy_arg(ProxyType *type, Datum val, Oid val_type)
+{
+	Oid			out_func;
+	Oid			in_func;
+	Oid			io_param;
+	bool		is_varlena;
+	char	   *str;
+
+	if (val_type == type->type_oid)
+		return datumCopy(val, type->by_value, type->length);
+
+	getTypeOutputInfo(val_type, &out_func, &is_varlena);
+	str = OidOutputFunctionCall(out_func, val);
+
+	getTypeInputInfo(type->type_oid, &in_func, &io_param);
+	return OidInputFunctionCall(in_func, str, io_param, -1);
+}
+
+/* Compile the function and fill arguments */
+static void
+setup_call(AsyncCall *call, FunctionCallInfo fcinfo, Oid fn_oid)
+{
+	ProxyFunction *func;
+	AclResult	aclresult;
+	Oid			val_type;
+	Datum		val;
+	bool		is_varlena;
+	int			i;
+	MemoryContext old_ctx;
+
+	aclresult = pg_proc_aclcheck(fn_oid, GetUserId(), ACL_EXECUTE);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_PROC, get_func_name(fn_oid));
+
+	fmgr_info_cxt(fn_oid, &call->flinfo, call->ctx);
+	if (call->flinfo.fn_addr != plproxy_call_handler)
+		elog(ERROR, "PL/Proxy: asynchronous call requires plain PL/Proxy function: %s",
+			 format_procedure(fn_oid));
+
+	call->fcinfo.flinfo = &call->flinfo;
+	call->fcinfo.nargs = call->flinfo.fn_nargs;
+
+	func = plproxy_compile_and_cache(&call->fcinfo);
+	call->func = func;
+
+	if (func->dynamic_record)
+		plproxy_error(func, "asynchronous call requires function with known result type");
+	if (func->cache_ttl > 0 || func->cache_op != CACHE_NONE)
+		plproxy_error(func, "result CACHE is not supported in asynchronous call");
+	if (PG_NARGS() - 1 != func->arg_count)
+		plproxy_error(func, "asynchronous call got %d arguments, expected %d",
+					  PG_NARGS() - 1, func->arg_count);
+
+	for (i = 0; i < func->arg_count; i++)
+	{
+		if (PG_ARGISNULL(i + 1))
+		{
+			call->fcinfo.argnull[i] = true;
+			continue;
+		}
+
+		val_type = get_fn_expr_argtype(fcinfo->flinfo, i + 1);
+		if (!OidIsValid(val_type))
+			plproxy_error(func, "cannot determine type of argument %d", i + 1);
+
+		old_ctx = MemoryContextSwitchTo(call->ctx);
+		val = copy_arg(func->arg_types[i], PG_GETARG_DATUM(i + 1), val_type);
+		MemoryContextSwitchTo(old_ctx);
+
+		call->fcinfo.arg[i] = val;
+	}
+
+	/* results are returned as text */
+	if (func->ret_composite)
+		getTypeOutputInfo(func->ret_composite->tupdesc->tdtypeid,
+						  &call->out_func, &is_varlena);
+	else if (func->ret_scalar->type_oid != VOIDOID)
+		getTypeOutputInfo(func->ret_scalar->type_oid,
+						  &call->out_func, &is_varlena);
+}
+
+/* Wait for results, caller must drop the call on error */
+static void
+finish_call(AsyncCall *call)
+{
+	ProxyExec  *exec = call->exec;
+
+	if (call->finished)
+		return;
+
+	call->finished = true;
+
+	/* failed execution is released by plproxy_exec_finish() */
+	call->exec = NULL;
+	plproxy_exec_finish(exec);
+	call->exec = exec;
+
+	if (!call->flinfo.fn_retset && exec->ret_total != 1)
+		plproxy_error_with_state(call->func,
+			(exec->ret_total < 1) ? ERRCODE_NO_DATA_FOUND : ERRCODE_TOO_MANY_ROWS,
+			"Non-SETOF function requires 1 row from remote query, got %d",
+				exec->ret_total);
+}
+
+/*
+ * Start asynchronous call.
+ *
+ * plproxy_call_async(regprocedure [, variadic "any"]) returns int4
+ */
+Datum
+plproxy_call_async(PG_FUNCTION_ARGS)
+{
+	Oid			fn_oid;
+	AsyncCall  *call;
+	ProxyCluster *cluster;
+	int			err;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+	fn_oid = PG_GETARG_OID(0);
+
+	/* prepare SPI */
+	err = SPI_connect();
+	if (err != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect: %s", SPI_result_code_string(err));
+
+	/* do the initialization also under SPI */
+	plproxy_startup_init();
+
+	call = new_call();
+	PG_TRY();
+	{
+		setup_call(call, fcinfo, fn_oid);
+
+		/* get actual cluster to run on */
+		cluster = plproxy_find_cluster(call->func, &call->fcinfo);
+		call->exec = plproxy_exec_launch(call->func, cluster, &call->fcinfo);
+	}
+	PG_CATCH();
+	{
+		/* failed launch is released by plproxy_exec_launch() */
+		drop_call(call, false);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* done with SPI */
+	err = SPI_finish();
+	if (err != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish: %s", SPI_result_code_string(err));
+
+	PG_RETURN_INT32(call->handle);
+}
+
+/*
+ * Wait until results of asynchronous call have arrived.
+ *
+ * plproxy_wait(int4) returns void
+ */
+Datum
+plproxy_wait(PG_FUNCTION_ARGS)
+{
+	AsyncCall  *call = find_call(PG_GETARG_INT32(0));
+
+	PG_TRY();
+	{
+		finish_call(call);
+	}
+	PG_CATCH();
+	{
+		drop_call(call, true);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	PG_RETURN_VOID();
+}
+
+/* Return next result row as text */
+static Datum
+fetch_row(AsyncCall *call, bool *isnull)
+{
+	Datum		val;
+
+	call->fcinfo.isnull = false;
+	val = plproxy_result(call->exec, &call->fcinfo);
+
+	if (call->fcinfo.isnull || !OidIsValid(call->out_func))
+	{
+		*isnull = true;
+		return (Datum) 0;
+	}
+
+	*isnull = false;
+	return CStringGetTextDatum(OidOutputFunctionCall(call->out_func, val));
+}
+
+/*
+ * Return results of asynchronous call, waiting if needed.
+ * The call is dropped after all rows are returned.
+ *
+ * plproxy_fetch(int4) returns setof text
+ */
+Datum
+plproxy_fetch(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *ret_ctx;
+	AsyncCall  *call;
+	Datum		val = (Datum) 0;
+	bool		isnull = false;
+	bool		done = false;
+
+	if (SRF_IS_FIRSTCALL())
+		SRF_FIRSTCALL_INIT();
+	ret_ctx = SRF_PERCALL_SETUP();
+
+	call = find_call(PG_GETARG_INT32(0));
+
+	PG_TRY();
+	{
+		finish_call(call);
+
+		if (call->exec->ret_total > 0)
+			val = fetch_row(call, &isnull);
+		else
+			done = true;
+	}
+	PG_CATCH();
+	{
+		drop_call(call, true);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (done)
+	{
+		drop_call(call, true);
+		SRF_RETURN_DONE(ret_ctx);
+	}
+
+	fcinfo->isnull = isnull;
+	SRF_RETURN_NEXT(ret_ctx, val);
+}
+
+/*
+ * Memory used by results of asynchronous call that have
+ * arrived so far.  They are kept by libpq, outside of
+ * Postgres memory accounting.
+ *
+ * plproxy_result_bytes(int4) returns int8
+ */
+Datum
+plproxy_result_bytes(PG_FUNCTION_ARGS)
+{
+	AsyncCall  *call = find_call(PG_GETARG_INT32(0));
+
+	PG_RETURN_INT64(call->exec->result_bytes);
+}
+
+/*
+ * Memory used by results of last finished call, synchronous
+ * or asynchronous.  Calls answered from result cache do not
+ * change it.
+ *
+ * plproxy_last_result_bytes() returns int8
+ */
+Datum
+plproxy_last_result_bytes(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT64(plproxy_exec_last_result_bytes());
+}
@@ -0,0 +1,664 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Copyright (c) 2006 Sven Suursoho, Skype Technologies OÜ
+ * Copyright (c) 2007 Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Proxy-side cache for function results.
+ *
+ * Entries are kept in backend-local memory, looked up by binary key
+ * from AA-tree and evicted in LRU order when over the limits.
+ * Each entry contains rows of Datums, which are copied out on lookup,
+ * so entries can be freed any time without affecting callers.
+ */
+
+#include "plproxy.h"
+
+/* Lookup key for tree */
+typedef struct CacheKey
+{
+	const char *data;
+	int			len;
+} CacheKey;
+
+typedef struct CacheEntry
+{
+	struct AANode node;			/* node in cache_tree */
+
+	struct CacheEntry *lru_prev;	/* more recently used */
+	struct CacheEntry *lru_next;	/* less recently used */
+
+	Oid			owner;			/* function that stored the entry */
+	time_t		expire;			/* when entry becomes invalid */
+	Size		size;			/* approximate memory usage */
+
+	char	   *key;
+	int			key_len;
+
+	ProxyResultRows rows;
+} CacheEntry;
+
+/* all cache data is allocated here */
+static MemoryContext cache_ctx = NULL;
+
+/* key => entry */
+static struct AATree cache_tree;
+
+/* entries in use order */
+static CacheEntry *lru_head = NULL;
+static CacheEntry *lru_tail = NULL;
+
+/* sum of entry sizes */
+static Size cache_size = 0;
+
+static int
+cache_key_cmp(uintptr_t val, struct AANode *node)
+{
+	const CacheKey *key = (const CacheKey *) val;
+	const CacheEntry *entry = container_of(node, CacheEntry, node);
+
+	if (key->len != entry->key_len)
+		return (key->len < entry->key_len) ? -1 : 1;
+	return memcmp(key->data, entry->key, key->len);
+}
+
+static void
+lru_unlink(CacheEntry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(CacheEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = entry;
+	else
+		lru_tail = entry;
+	lru_head = entry;
+}
+
+/* Called by aatree when entry is removed */
+static void
+cache_entry_free(struct AANode *node, void *arg)
+{
+	CacheEntry *entry = container_of(node, CacheEntry, node);
+	ProxyResultRows *rows = &entry->rows;
+	int			i;
+
+	lru_unlink(entry);
+	cache_size -= entry->size;
+
+	if (!rows->by_value)
+	{
+		for (i = 0; i < rows->nrows; i++)
+		{
+			if (!rows->nulls[i])
+				pfree(DatumGetPointer(rows->values[i]));
+		}
+	}
+	pfree(entry);
+}
+
+static void
+cache_entry_drop(CacheEntry *entry)
+{
+	CacheKey	key;
+
+	key.data = entry->key;
+	key.len = entry->key_len;
+	aatree_remove(&cache_tree, (uintptr_t) &key);
+}
+
+/* Initialize cache structures */
+void
+plproxy_cache_init(void)
+{
+	cache_ctx = AllocSetContextCreate(TopMemoryContext,
+									  "PL/Proxy result cache",
+									  ALLOCSET_DEFAULT_MINSIZE,
+									  ALLOCSET_DEFAULT_INITSIZE,
+									  ALLOCSET_DEFAULT_MAXSIZE);
+	aatree_init(&cache_tree, cache_key_cmp, cache_entry_free);
+}
+
+/*
+ * Find valid entry for key and copy its rows to CurrentMemoryContext.
+ *
+ * Returns NULL if not found.
+ */
+ProxyResultRows *
+plproxy_cache_lookup(const char *key_data, int key_len)
+{
+	CacheKey	key;
+	struct AANode *node;
+	CacheEntry *entry;
+	ProxyResultRows *res;
+	int			i;
+
+	key.data = key_data;
+	key.len = key_len;
+	node = aatree_search(&cache_tree, (uintptr_t) &key);
+	if (!node)
+		return NULL;
+
+	entry = container_of(node, CacheEntry, node);
+	if (entry->expire && entry->expire <= time(NULL))
+	{
+		cache_entry_drop(entry);
+		return NULL;
+	}
+
+	/* move to front */
+	lru_unlink(entry);
+	lru_push(entry);
+
+	res = palloc(sizeof(*res));
+	*res = entry->rows;
+	res->values = palloc(res->nrows * sizeof(Datum));
+	res->nulls = palloc(res->nrows * sizeof(bool));
+	for (i = 0; i < res->nrows; i++)
+	{
+		res->nulls[i] = entry->rows.nulls[i];
+		if (res->nulls[i])
+			res->values[i] = (Datum) 0;
+		else
+			res->values[i] = datumCopy(entry->rows.values[i],
+									   res->by_value, res->typlen);
+	}
+	return res;
+}
+
+/*
+ * Store copy of rows under key, replacing old entry.
+ * With ttl 0 the entry does not expire.
+ *
+ * Older entries are evicted if needed to stay under limits.
+ * Too big results are not stored.
+ */
+void
+plproxy_cache_store(Oid owner, const char *key_data, int key_len,
+					int ttl, ProxyResultRows *rows)
+{
+	CacheKey	key;
+	CacheEntry *entry;
+	MemoryContext old_ctx;
+	Size		size;
+	int			i;
+
+	/* drop old entry */
+	plproxy_cache_remove(key_data, key_len);
+
+	size = sizeof(*entry) + key_len + rows->nrows * (sizeof(Datum) + sizeof(bool));
+	if (!rows->by_value)
+	{
+		for (i = 0; i < rows->nrows; i++)
+		{
+			if (!rows->nulls[i])
+				size += datumGetSize(rows->values[i], false, rows->typlen);
+		}
+	}
+	if (size > PLPROXY_CACHE_MAX_SIZE / 4)
+		return;
+
+	/* make room */
+	while (lru_tail && (cache_tree.count >= PLPROXY_CACHE_MAX_ENTRIES
+						|| cache_size + size > PLPROXY_CACHE_MAX_SIZE))
+		cache_entry_drop(lru_tail);
+
+	old_ctx = MemoryContextSwitchTo(cache_ctx);
+
+	/* entry, key and row arrays in one block */
+	entry = palloc(MAXALIGN(sizeof(*entry))
+				   + MAXALIGN(rows->nrows * sizeof(Datum))
+				   + rows->nrows * sizeof(bool)
+				   + key_len);
+	memset(entry, 0, sizeof(*entry));
+	entry->rows = *rows;
+	entry->rows.values = (Datum *) ((char *) entry + MAXALIGN(sizeof(*entry)));
+	entry->rows.nulls = (bool *) ((char *) entry->rows.values
+								  + MAXALIGN(rows->nrows * sizeof(Datum)));
+	entry->key = (char *) (entry->rows.nulls + rows->nrows);
+	entry->key_len = key_len;
+	memcpy(entry->key, key_data, key_len);
+
+	for (i = 0; i < rows->nrows; i++)
+	{
+		entry->rows.nulls[i] = rows->nulls[i];
+		if (rows->nulls[i])
+			entry->rows.values[i] = (Datum) 0;
+		else
+			entry->rows.values[i] = datumCopy(rows->values[i],
+											  rows->by_value, rows->typlen);
+	}
+
+	MemoryContextSwitchTo(old_ctx);
+
+	entry->owner = owner;
+	entry->expire = (ttl > 0) ? time(NULL) + ttl : 0;
+	entry->size = size;
+
+	key.data = entry->key;
+	key.len = entry->key_len;
+	aatree_insert(&cache_tree, (uintptr_t) &key, &entry->node);
+	lru_push(entry);
+	cache_size += size;
+}
+
+/* Drop entry for key, if exists */
+void
+plproxy_cache_remove(const char *key_data, int key_len)
+{
+	CacheKey	key;
+
+	key.data = key_data;
+	key.len = key_len;
+	aatree_remove(&cache_tree, (uintptr_t) &key);
+}
+
+/* Drop all entries stored by function */
+void
+plproxy_cache_purge(Oid owner)
+{
+	CacheEntry *entry,
+			   *next;
+
+	for (entry = lru_head; entry; entry = next)
+	{
+		next = entry->lru_next;
+		if (entry->owner == owner)
+			cache_entry_drop(entry);
+	}
+}
+
+/*
+ * Function result caching for CACHE TTL.
+ */
+
+/*
+ * Append argument value to cache key.
+ *
+ * Binary send form is used when type has one, as unlike text
+ * output it does not depend on GUCs like extra_float_digits
+ * or DateStyle and different values cannot give same bytes.
+ */
+static void
+append_key_value(StringInfo key, ProxyType *type, Datum val)
+{
+	bytea	   *bin;
+	char	   *txt;
+	int			len,
+				fmt;
+
+	if (type->send_valid)
+	{
+		bin = SendFunctionCall(&type->io.out.send_func, val);
+		txt = VARDATA(bin);
+		len = VARSIZE(bin) - VARHDRSZ;
+		appendStringInfoChar(key, 'B');
+	}
+	else
+	{
+		txt = plproxy_send_type(type, val, false, &len, &fmt);
+		len = strlen(txt);
+		appendStringInfoChar(key, 'V');
+	}
+	appendBinaryStringInfo(key, (char *) &len, sizeof(len));
+	appendBinaryStringInfo(key, txt, len);
+}
+
+/*
+ * Build cache key for function call.
+ *
+ * Contains kind tag, function oid, current user and
+ * values of arguments.
+ * The user is included because remote permissions may differ.
+ */
+static StringInfo
+result_cache_key(ProxyFunction *func, FunctionCallInfo fcinfo, char kind)
+{
+	StringInfo	key = makeStringInfo();
+	Oid			user_oid = GetUserId();
+	int			i;
+
+	appendStringInfoChar(key, kind);
+	appendBinaryStringInfo(key, (char *) &func->oid, sizeof(Oid));
+	appendBinaryStringInfo(key, (char *) &user_oid, sizeof(Oid));
+
+	for (i = 0; i < func->arg_count; i++)
+	{
+		if (PG_ARGISNULL(i))
+		{
+			appendStringInfoChar(key, 'N');
+			continue;
+		}
+		append_key_value(key, func->arg_types[i], PG_GETARG_DATUM(i));
+	}
+	return key;
+}
+
+/*
+ * Convert all results to Datums in CurrentMemoryContext.
+ *
+ * Non-SETOF function results are taken only if there
+ * is exactly one row, otherwise NULL is returned and
+ * the results are left in place for the usual error.
+ */
+static ProxyResultRows *
+fetch_results(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ProxyExec  *exec = func->cur_exec;
+	ProxyResultRows *rows;
+	int			i;
+
+	if (!fcinfo->flinfo->fn_retset && exec->ret_total != 1)
+		return NULL;
+
+	rows = palloc(sizeof(*rows));
+	rows->nrows = exec->ret_total;
+	rows->values = palloc(rows->nrows * sizeof(Datum));
+	rows->nulls = palloc(rows->nrows * sizeof(bool));
+	if (func->ret_composite)
+	{
+		rows->by_value = false;
+		rows->typlen = -1;
+	}
+	else
+	{
+		rows->by_value = func->ret_scalar->by_value;
+		rows->typlen = func->ret_scalar->length;
+	}
+
+	for (i = 0; i < rows->nrows; i++)
+	{
+		fcinfo->isnull = false;
+		rows->values[i] = plproxy_result(exec, fcinfo);
+		rows->nulls[i] = fcinfo->isnull;
+	}
+	fcinfo->isnull = false;
+
+	return rows;
+}
+
+/*
+ * Keys for CACHE GET/SET/INVALIDATE.
+ *
+ * Values are stored as text, so functions with different
+ * types can share keys.  As other backends do not see SET
+ * and INVALIDATE, values expire after CACHE KEY TTL seconds.
+ */
+
+/*
+ * Evaluate key and optionally value of CACHE statement.
+ *
+ * Key is key name with current user and text form of key
+ * arguments row, it does not depend on function.
+ * The user is included because remote permissions may differ.
+ */
+static StringInfo
+key_cache_eval(ProxyFunction *func, FunctionCallInfo fcinfo, char **value)
+{
+	StringInfo	key = makeStringInfo();
+	Oid			user_oid = GetUserId();
+	TupleDesc	desc;
+	HeapTuple	row;
+	char	   *args;
+
+	plproxy_query_exec(func, fcinfo, func->cache_key_sql, NULL, 0);
+	if (SPI_processed != 1)
+		plproxy_error(func, "CACHE key query must return 1 row");
+
+	desc = SPI_tuptable->tupdesc;
+	row = SPI_tuptable->vals[0];
+
+	args = SPI_getvalue(row, desc, 1);
+	appendStringInfoChar(key, 'K');
+	appendBinaryStringInfo(key, (char *) &user_oid, sizeof(Oid));
+	appendStringInfoString(key, func->cache_key_name);
+	appendStringInfoChar(key, '\0');
+	appendStringInfoString(key, args);
+
+	if (value)
+		*value = SPI_getvalue(row, desc, 2);
+
+	return key;
+}
+
+/* Put text value into single-row result */
+static ProxyResultRows *
+text_rows(const char *value)
+{
+	ProxyResultRows *rows = palloc(sizeof(*rows));
+
+	rows->nrows = 1;
+	rows->values = palloc(sizeof(Datum));
+	rows->nulls = palloc(sizeof(bool));
+	rows->by_value = false;
+	rows->typlen = -1;
+	rows->nulls[0] = (value == NULL);
+	rows->values[0] = value ? CStringGetTextDatum(value) : (Datum) 0;
+	return rows;
+}
+
+/*
+ * Look up cached results for function call.
+ *
+ * Returns NULL if function does not use caching or nothing
+ * was found.  Otherwise also sets *key for plproxy_cache_call_fill().
+ * Must be called under SPI.
+ */
+ProxyResultRows *
+plproxy_cache_call_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+						  StringInfo *key)
+{
+	ProxyResultRows *rows;
+	char	   *txt;
+
+	*key = NULL;
+
+	if (func->cache_ttl > 0)
+	{
+		*key = result_cache_key(func, fcinfo, 'R');
+		return plproxy_cache_lookup((*key)->data, (*key)->len);
+	}
+
+	if (func->cache_op != CACHE_GET)
+		return NULL;
+
+	*key = key_cache_eval(func, fcinfo, NULL);
+	rows = plproxy_cache_lookup((*key)->data, (*key)->len);
+	if (rows && !rows->nulls[0])
+	{
+		/* convert text to function result type */
+		txt = TextDatumGetCString(rows->values[0]);
+		rows->values[0] = plproxy_recv_type(func->ret_scalar, txt,
+											strlen(txt), false);
+		rows->by_value = func->ret_scalar->by_value;
+		rows->typlen = func->ret_scalar->length;
+	}
+	return rows;
+}
+
+/*
+ * Convert fresh results to Datums in CurrentMemoryContext
+ * and store them in cache under key.
+ */
+ProxyResultRows *
+plproxy_cache_call_fill(ProxyFunction *func, FunctionCallInfo fcinfo,
+						StringInfo key)
+{
+	ProxyResultRows *rows,
+			   *stored;
+	char	   *txt = NULL;
+	int			len,
+				fmt;
+
+	rows = fetch_results(func, fcinfo);
+	if (!rows)
+		return NULL;
+
+	if (func->cache_op == CACHE_GET)
+	{
+		if (!rows->nulls[0])
+			txt = plproxy_send_type(func->cache_out_type, rows->values[0],
+									false, &len, &fmt);
+		stored = text_rows(txt);
+		plproxy_cache_store(InvalidOid, key->data, key->len,
+							func->cache_key_ttl, stored);
+	}
+	else
+	{
+		plproxy_cache_store(func->oid, key->data, key->len, func->cache_ttl, rows);
+	}
+
+	return rows;
+}
+
+/*
+ * Apply CACHE SET or INVALIDATE after successful remote call.
+ * Must be called under SPI.
+ */
+void
+plproxy_cache_call_update(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	StringInfo	key;
+	ProxyResultRows *rows;
+	char	   *value;
+
+	switch (func->cache_op)
+	{
+		case CACHE_SET:
+			key = key_cache_eval(func, fcinfo, &value);
+			rows = text_rows(value);
+			plproxy_cache_store(InvalidOid, key->data, key->len,
+								func->cache_key_ttl, rows);
+			break;
+		case CACHE_INVALIDATE:
+			key = key_cache_eval(func, fcinfo, NULL);
+			plproxy_cache_remove(key->data, key->len);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Look up cached result of CLUSTER or CONNECT resolver function.
+ *
+ * Kind is 'C' for cluster name or 'N' for connect string.
+ * Key contains only values of resolver query parameters, so calls
+ * that differ in other arguments share the entry.
+ * Returns NULL if not found, then *key is set for
+ * plproxy_cache_resolved_store().
+ */
+char *
+plproxy_cache_resolved_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+							  ProxyQuery *query, char kind, StringInfo *key)
+{
+	StringInfo	buf = makeStringInfo();
+	Oid			user_oid = GetUserId();
+	ProxyResultRows *rows;
+	int			i,
+				idx;
+
+	appendStringInfoChar(buf, kind);
+	appendBinaryStringInfo(buf, (char *) &func->oid, sizeof(Oid));
+	appendBinaryStringInfo(buf, (char *) &user_oid, sizeof(Oid));
+
+	/* same parameters as plproxy_query_exec() uses */
+	for (i = 0; i < query->arg_count; i++)
+	{
+		idx = query->arg_lookup[i];
+		if (PG_ARGISNULL(idx))
+		{
+			appendStringInfoChar(buf, 'N');
+			continue;
+		}
+		append_key_value(buf, func->arg_types[idx], PG_GETARG_DATUM(idx));
+	}
+
+	*key = buf;
+	rows = plproxy_cache_lookup(buf->data, buf->len);
+	if (!rows || rows->nulls[0])
+		return NULL;
+	return TextDatumGetCString(rows->values[0]);
+}
+
+/*
+ * Remember result of resolver function.
+ */
+void
+plproxy_cache_resolved_store(ProxyFunction *func, StringInfo key,
+							 const char *name, int ttl)
+{
+	ProxyResultRows *rows = text_rows(name);
+
+	plproxy_cache_store(func->oid, key->data, key->len, ttl, rows);
+}
+
+/*
+ * Look up cached hash values for RUN ON function.
+ *
+ * Key contains values of hash query parameters and the cluster
+ * partition generation, so entries from before partition reload
+ * are not found.  Not used for SPLIT calls.  Returns NULL if not
+ * found, then *key is set for storing.  Values are int4 Datums.
+ */
+ProxyResultRows *
+plproxy_cache_hash_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+						  StringInfo *key)
+{
+	ProxyCluster *cluster = func->cur_exec->cluster;
+	ProxyQuery *q = func->hash_sql;
+	StringInfo	buf = makeStringInfo();
+	Oid			user_oid = GetUserId();
+	int			i,
+				idx;
+
+	appendStringInfoChar(buf, 'H');
+	appendBinaryStringInfo(buf, (char *) &func->oid, sizeof(Oid));
+	appendBinaryStringInfo(buf, (char *) &user_oid, sizeof(Oid));
+	appendBinaryStringInfo(buf, (char *) &cluster->part_generation, sizeof(uint32));
+	appendStringInfoString(buf, cluster->name);
+	appendStringInfoChar(buf, '\0');
+
+	/* same parameters as plproxy_query_exec() uses */
+	for (i = 0; i < q->arg_count; i++)
+	{
+		idx = q->arg_lookup[i];
+		if (PG_ARGISNULL(idx))
+		{
+			appendStringInfoChar(buf, 'N');
+			continue;
+		}
+		append_key_value(buf, func->arg_types[idx], PG_GETARG_DATUM(idx));
+	}
+
+	*key = buf;
+	return plproxy_cache_lookup(buf->data, buf->len);
+}
+
@@ -29,18 +29,42 @@
 static MemoryContext cluster_mem;
 
 /*
- * Tree of clusters.
+ * Hash of clusters.
  *
  * For searching by name.
  */
-static struct AATree cluster_tree;
+static struct StrHash cluster_hash;
 
 /*
  * Similar list for fake clusters (for CONNECT functions).
  *
- * Cluster name will be actual connect string.
+ * Cluster name will be normalized connect string.
  */
-static struct AATree fake_cluster_tree;
+static struct StrHash fake_cluster_hash;
+
+/*
+ * Connect string as given to CONNECT.  Several strings may
+ * point to same fake cluster, then they share connections.
+ */
+typedef struct FakeConnect
+{
+	struct StrHashNode node;	/* Node in fake_connect_hash */
+	char	   *connect_str;
+	ProxyCluster *cluster;
+	struct FakeConnect *lru_prev;	/* more recently used */
+	struct FakeConnect *lru_next;	/* less recently used */
+} FakeConnect;
+
+/* connect string -> FakeConnect, size limited by PLPROXY_FAKE_CLUSTER_MAX */
+static struct StrHash fake_connect_hash;
+static FakeConnect *fake_lru_head;
+static FakeConnect *fake_lru_tail;
+
+/*
+ * Bumped on any role change, invalidates userinfo
+ * remembered in ProxyFunction.  Zero means no tracking.
+ */
+static uint32 user_generation;
 
 /* plan for fetching cluster version */
 static void *version_plan;
@@ -66,8 +90,12 @@ static const char config_sql[] = "select * from plproxy.get_cluster_config($1)";
 static const char *cluster_config_options[] = {
 	"statement_timeout",
 	"connection_lifetime",
+	"idle_timeout",
 	"query_timeout",
 	"disable_binary",
+	"retry_send",
+	"max_result_rows",
+	"max_result_bytes",
 	"keepalive_idle",
 	"keepalive_interval",
 	"keepalive_count",
@@ -88,58 +116,31 @@ check_valid_partcount(int n)
 	return (n > 0) && !(n & (n - 1));
 }
 
-static int cluster_name_cmp(uintptr_t val, struct AANode *node)
-{
-	const char *name = (const char *)val;
-	const ProxyCluster *cluster = container_of(node, ProxyCluster, node);
-
-	return strcmp(name, cluster->name);
-}
-
-static int conn_cstr_cmp(uintptr_t val, struct AANode *node)
-{
-	const char *name = (const char *)val;
-	const ProxyConnection *conn = container_of(node, ProxyConnection, node);
-
-	return strcmp(name, conn->connstr);
-}
-
-static void conn_free(struct AANode *node, void *arg)
+static void conn_free(struct StrHashNode *node, void *arg)
 {
-	ProxyConnection *conn = container_of(node, ProxyConnection, node);
+	ProxyDatabase *db = container_of(node, ProxyDatabase, node);
 
-	aatree_destroy(&conn->userstate_tree);
-	if (conn->res)
-		PQclear(conn->res);
-	pfree(conn);
+	strhash_destroy(&db->userstate_hash);
+	pfree(db);
 }
 
-static int state_user_cmp(uintptr_t val, struct AANode *node)
-{
-	const char *name = (const char *)val;
-	const ProxyConnectionState *state = container_of(node, ProxyConnectionState, node);
-
-	return strcmp(name, state->userinfo->username);
-}
-
-static void state_free(struct AANode *node, void *arg)
+static void state_free(struct StrHashNode *node, void *arg)
 {
 	ProxyConnectionState *state = container_of(node, ProxyConnectionState, node);
+	ProxyConnectionState *next;
 
-	plproxy_disconnect(state);
-	memset(state, 0, sizeof(*state));
-	pfree(state);
-}
-
-static int userinfo_cmp(uintptr_t val, struct AANode *node)
-{
-	const char *name = (const char *)val;
-	const ConnUserInfo *info = container_of(node, ConnUserInfo, node);
-
-	return strcmp(name, info->username);
+	/* also extra connections */
+	while (state)
+	{
+		next = state->next;
+		plproxy_disconnect(state);
+		memset(state, 0, sizeof(*state));
+		pfree(state);
+		state = next;
+	}
 }
 
-static void userinfo_free(struct AANode *node, void *arg)
+static void userinfo_free(struct StrHashNode *node, void *arg)
 {
 	ConnUserInfo *info = container_of(node, ConnUserInfo, node);
 	pfree(info->username);
@@ -167,8 +168,9 @@ plproxy_cluster_cache_init(void)
 										ALLOCSET_SMALL_MINSIZE,
 										ALLOCSET_SMALL_INITSIZE,
 										ALLOCSET_SMALL_MAXSIZE);
-	aatree_init(&cluster_tree, cluster_name_cmp, NULL);
-	aatree_init(&fake_cluster_tree, cluster_name_cmp, NULL);
+	strhash_init(&cluster_hash, cluster_mem, NULL);
+	strhash_init(&fake_cluster_hash, cluster_mem, NULL);
+	strhash_init(&fake_connect_hash, cluster_mem, NULL);
 }
 
 /* initialize plans on demand */
@@ -218,15 +220,14 @@ plproxy_cluster_plan_init(void)
 static void
 free_connlist(ProxyCluster *cluster)
 {
-	aatree_destroy(&cluster->conn_tree);
+	strhash_destroy(&cluster->conn_hash);
 
 	pfree(cluster->part_map);
-	pfree(cluster->active_list);
 
 	cluster->part_map = NULL;
 	cluster->part_count = 0;
 	cluster->part_mask = 0;
-	cluster->active_count = 0;
+	cluster->db_count = 0;
 }
 
 /*
@@ -235,27 +236,28 @@ free_connlist(ProxyCluster *cluster)
 static void
 add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
 {
-	struct AANode *node;
-	ProxyConnection *conn = NULL;
+	struct StrHashNode *node;
+	ProxyDatabase *db = NULL;
 
 	/* check if already have it */
-	node = aatree_search(&cluster->conn_tree, (uintptr_t)connstr);
+	node = strhash_search(&cluster->conn_hash, connstr);
 	if (node)
-		conn = container_of(node, ProxyConnection, node);
+		db = container_of(node, ProxyDatabase, node);
 
 	/* add new connection */
-	if (!conn)
+	if (!db)
 	{
-		conn = MemoryContextAllocZero(cluster_mem, sizeof(ProxyConnection));
-		conn->connstr = MemoryContextStrdup(cluster_mem, connstr);
-		conn->cluster = cluster;
+		db = MemoryContextAllocZero(cluster_mem, sizeof(ProxyDatabase));
+		db->connstr = MemoryContextStrdup(cluster_mem, connstr);
+		db->cluster = cluster;
+		db->index = cluster->db_count++;
 
-		aatree_init(&conn->userstate_tree, state_user_cmp, state_free);
+		strhash_init(&db->userstate_hash, cluster_mem, state_free);
 
-		aatree_insert(&cluster->conn_tree, (uintptr_t)connstr, &conn->node);
+		strhash_insert(&cluster->conn_hash, db->connstr, &db->node);
 	}
 
-	cluster->part_map[part_num] = conn;
+	cluster->part_map[part_num] = db;
 }
 
 /*
@@ -303,10 +305,18 @@ set_config_key(ProxyFunction *func, ProxyConfig *cf, const char *key, const char
 		/* ignore */ ;
 	else if (pg_strcasecmp("connection_lifetime", key) == 0)
 		cf->connection_lifetime = atoi(val);
+	else if (pg_strcasecmp("idle_timeout", key) == 0)
+		cf->idle_timeout = atoi(val);
 	else if (pg_strcasecmp("query_timeout", key) == 0)
 		cf->query_timeout = atoi(val);
 	else if (pg_strcasecmp("disable_binary", key) == 0)
 		cf->disable_binary = atoi(val);
+	else if (pg_strcasecmp("retry_send", key) == 0)
+		cf->retry_send = atoi(val);
+	else if (pg_strcasecmp("max_result_rows", key) == 0)
+		cf->max_result_rows = atoi(val);
+	else if (pg_strcasecmp("max_result_bytes", key) == 0)
+		cf->max_result_bytes = strtoll(val, NULL, 10);
 	else if (pg_strcasecmp("keepalive_idle", key) == 0)
 		cf->keepidle = atoi(val);
 	else if (pg_strcasecmp("keepalive_interval", key) == 0)
@@ -378,11 +388,11 @@ allocate_cluster_partitions(ProxyCluster *cluster, int nparts)
 
 	cluster->part_count = nparts;
 	cluster->part_mask = cluster->part_count - 1;
+	cluster->part_generation++;
 
 	/* allocate lists */
 	old_ctx = MemoryContextSwitchTo(cluster_mem);
-	cluster->part_map = palloc0(nparts * sizeof(ProxyConnection *));
-	cluster->active_list = palloc0(nparts * sizeof(ProxyConnection *));
+	cluster->part_map = palloc0(nparts * sizeof(ProxyDatabase *));
 	MemoryContextSwitchTo(old_ctx);
 }
 
@@ -764,7 +774,7 @@ determine_compat_mode(ProxyCluster *cluster)
 		elog(ERROR, "Pl/Proxy: cluster not found: %s", cluster->name);
 }
 
-static void inval_one_umap(struct AANode *n, void *arg)
+static void inval_one_umap(struct StrHashNode *n, void *arg)
 {
 	ConnUserInfo *info = container_of(n, ConnUserInfo, node);
 	SCInvalArg newStamp;
@@ -785,14 +795,14 @@ static void inval_one_umap(struct AANode *n, void *arg)
 		info->needs_reload = true;
 }
 
-static void inval_umapping(struct AANode *n, void *arg)
+static void inval_umapping(struct StrHashNode *n, void *arg)
 {
 	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
 
-	aatree_walk(&cluster->userinfo_tree, AA_WALK_IN_ORDER, inval_one_umap, arg);
+	strhash_walk(&cluster->userinfo_hash, inval_one_umap, arg);
 }
 
-static void inval_fserver(struct AANode *n, void *arg)
+static void inval_fserver(struct StrHashNode *n, void *arg)
 {
 	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
 	SCInvalArg newStamp = *(SCInvalArg *)arg;
@@ -823,9 +833,19 @@ static void
 ClusterSyscacheCallback(Datum arg, int cacheid, SCInvalArg newStamp)
 {
 	if (cacheid == FOREIGNSERVEROID)
-		aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, inval_fserver, &newStamp);
+		strhash_walk(&cluster_hash, inval_fserver, &newStamp);
 	else if (cacheid == USERMAPPINGOID)
-		aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, inval_umapping, &newStamp);
+		strhash_walk(&cluster_hash, inval_umapping, &newStamp);
+}
+
+/*
+ * Syscache inval callback function for roles.
+ */
+static void
+UserSyscacheCallback(Datum arg, int cacheid, SCInvalArg newStamp)
+{
+	if (++user_generation == 0)
+		user_generation = 1;
 }
 
 /*
@@ -836,6 +856,8 @@ plproxy_syscache_callback_init(void)
 {
 	CacheRegisterSyscacheCallback(FOREIGNSERVEROID, ClusterSyscacheCallback, (Datum) 0);
 	CacheRegisterSyscacheCallback(USERMAPPINGOID, ClusterSyscacheCallback, (Datum) 0);
+	CacheRegisterSyscacheCallback(AUTHOID, UserSyscacheCallback, (Datum) 0);
+	user_generation = 1;
 }
 
 #else /* !PLPROXY_USE_SQLMED */
@@ -882,8 +904,8 @@ new_cluster(const char *name)
 	cluster = palloc0(sizeof(*cluster));
 	cluster->name = pstrdup(name);
 
-	aatree_init(&cluster->conn_tree, conn_cstr_cmp, conn_free);
-	aatree_init(&cluster->userinfo_tree, userinfo_cmp, userinfo_free);
+	strhash_init(&cluster->conn_hash, cluster_mem, conn_free);
+	strhash_init(&cluster->userinfo_hash, cluster_mem, userinfo_free);
 
 	MemoryContextSwitchTo(old_ctx);
 
@@ -895,27 +917,31 @@ new_cluster(const char *name)
  */
 #ifdef PLPROXY_USE_SQLMED
 
-static void inval_userinfo_state(struct AANode *node, void *arg)
+static void inval_userinfo_state(struct StrHashNode *node, void *arg)
 {
 	ProxyConnectionState *cur = container_of(node, ProxyConnectionState, node);
 	ConnUserInfo *userinfo = arg;
 
-	if (cur->userinfo == userinfo && cur->db)
-		plproxy_disconnect(cur);
+	/* connections used by calls in progress are left alone */
+	for (; cur; cur = cur->next)
+	{
+		if (cur->userinfo == userinfo && cur->db && !cur->owner)
+			plproxy_disconnect(cur);
+	}
 }
 
-static void inval_userinfo_conn(struct AANode *node, void *arg)
+static void inval_userinfo_conn(struct StrHashNode *node, void *arg)
 {
-	ProxyConnection *conn = container_of(node, ProxyConnection, node);
+	ProxyDatabase *db = container_of(node, ProxyDatabase, node);
 	ConnUserInfo *userinfo = arg;
 
-	aatree_walk(&conn->userstate_tree, AA_WALK_IN_ORDER, inval_userinfo_state, userinfo);
+	strhash_walk(&db->userstate_hash, inval_userinfo_state, userinfo);
 }
 
 static void inval_user_connections(ProxyCluster *cluster, ConnUserInfo *userinfo)
 {
 	/* find all connections with this user and drop them */
-	aatree_walk(&cluster->conn_tree, AA_WALK_IN_ORDER, inval_userinfo_conn, userinfo);
+	strhash_walk(&cluster->conn_hash, inval_userinfo_conn, userinfo);
 
 	/*
 	 * We can clear the flag only when it's certain
@@ -934,7 +960,7 @@ static ConnUserInfo *
 get_userinfo(ProxyCluster *cluster, Oid user_oid)
 {
 	ConnUserInfo *userinfo;
-	struct AANode *node;
+	struct StrHashNode *node;
 	const char *username;
 
 	username = GetUserNameFromId(user_oid
@@ -943,14 +969,14 @@ get_userinfo(ProxyCluster *cluster, Oid user_oid)
 #endif
 		);
 
-	node = aatree_search(&cluster->userinfo_tree, (uintptr_t)username);
+	node = strhash_search(&cluster->userinfo_hash, username);
 	if (node) {
 		userinfo = container_of(node, ConnUserInfo, node);
 	} else {
 		userinfo = MemoryContextAllocZero(cluster_mem, sizeof(*userinfo));
 		userinfo->username = MemoryContextStrdup(cluster_mem, username);
 
-		aatree_insert(&cluster->userinfo_tree, (uintptr_t)username, &userinfo->node);
+		strhash_insert(&cluster->userinfo_hash, userinfo->username, &userinfo->node);
 	}
 
 	if (userinfo->user_oid != user_oid)
@@ -1013,13 +1039,28 @@ refresh_cluster(ProxyFunction *func, ProxyCluster *cluster)
 		user_oid = GetUserId();
 	}
 
-	/* set up user cache */
-	uinfo = get_userinfo(cluster, user_oid);
+	/* set up user cache, reuse function's one if still valid */
+	if (func->cached_cluster == cluster && user_generation
+		&& func->cached_user_oid == user_oid
+		&& func->cached_user_gen == user_generation)
+	{
+		uinfo = func->cached_userinfo;
+	}
+	else
+	{
+		uinfo = get_userinfo(cluster, user_oid);
+		if (func->cached_cluster == cluster)
+		{
+			func->cached_userinfo = uinfo;
+			func->cached_user_oid = user_oid;
+			func->cached_user_gen = user_generation;
+		}
+	}
 	cluster->cur_userinfo = uinfo;
 
-	/* SQL/MED server reload */
+	/* SQL/MED server reload, postponed while partitions are in use */
 #ifdef PLPROXY_USE_SQLMED
-	if (cluster->needs_reload)
+	if (cluster->needs_reload && cluster->exec_count == 0)
 	{
 		ForeignServer *server;
 
@@ -1056,6 +1097,10 @@ refresh_cluster(ProxyFunction *func, ProxyCluster *cluster)
 			uinfo->needs_reload = false;
 	}
 
+	/* partitions are in use by calls in progress, reload later */
+	if (cluster->exec_count > 0)
+		return;
+
 	/* old-style cluster reload */
 	if (!cluster->sqlmed_cluster && !cluster->fake_cluster)
 		reload_plproxy_cluster(func, cluster);
@@ -1063,6 +1108,134 @@ refresh_cluster(ProxyFunction *func, ProxyCluster *cluster)
 	cluster->needs_reload = false;
 }
 
+/*
+ * Fake cluster LRU list handling.
+ */
+static void
+fake_lru_unlink(FakeConnect *fc)
+{
+	if (fc->lru_prev)
+		fc->lru_prev->lru_next = fc->lru_next;
+	else
+		fake_lru_head = fc->lru_next;
+	if (fc->lru_next)
+		fc->lru_next->lru_prev = fc->lru_prev;
+	else
+		fake_lru_tail = fc->lru_prev;
+	fc->lru_prev = fc->lru_next = NULL;
+}
+
+static void
+fake_lru_push(FakeConnect *fc)
+{
+	fc->lru_prev = NULL;
+	fc->lru_next = fake_lru_head;
+	if (fake_lru_head)
+		fake_lru_head->lru_prev = fc;
+	else
+		fake_lru_tail = fc;
+	fake_lru_head = fc;
+}
+
+/*
+ * Free fake cluster, closes its connections.
+ */
+static void
+fake_cluster_free(ProxyCluster *cluster)
+{
+	strhash_remove(&fake_cluster_hash, cluster->name);
+
+	strhash_destroy(&cluster->conn_hash);
+	strhash_destroy(&cluster->userinfo_hash);
+	pfree(cluster->part_map);
+	pfree((void *) cluster->name);
+	pfree(cluster);
+}
+
+/*
+ * Forget connect string, drop the cluster if it was last user.
+ */
+static void
+fake_connect_drop(FakeConnect *fc)
+{
+	ProxyCluster *cluster = fc->cluster;
+
+	fake_lru_unlink(fc);
+	strhash_remove(&fake_connect_hash, fc->connect_str);
+	pfree(fc->connect_str);
+	pfree(fc);
+
+	if (--cluster->fake_refs == 0)
+		fake_cluster_free(cluster);
+}
+
+/*
+ * Make room for new connect string.  Clusters with calls
+ * in progress are skipped, so limit may be exceeded temporarily.
+ */
+static void
+fake_connect_evict(void)
+{
+	FakeConnect *fc, *prev;
+
+	for (fc = fake_lru_tail; fc; fc = prev)
+	{
+		if (fake_connect_hash.count < PLPROXY_FAKE_CLUSTER_MAX)
+			break;
+		prev = fc->lru_prev;
+		if (fc->cluster->exec_count == 0)
+			fake_connect_drop(fc);
+	}
+}
+
+/*
+ * Put connect string into canonical form, so strings differing only
+ * in keyword order, whitespace or quoting map to same connections.
+ *
+ * Unparseable string is returned as-is, connect will report the error.
+ */
+static char *
+normalize_connstr(const char *connect_str)
+{
+#if PG_VERSION_NUM >= 80400
+	PQconninfoOption *opts, *o;
+	StringInfoData buf;
+	char	   *errmsg = NULL;
+	const char *p;
+
+	opts = PQconninfoParse(connect_str, &errmsg);
+	if (!opts)
+	{
+		if (errmsg)
+			PQfreemem(errmsg);
+		return pstrdup(connect_str);
+	}
+
+	/* options are returned in fixed order, only given ones have value */
+	initStringInfo(&buf);
+	for (o = opts; o->keyword; o++)
+	{
+		if (!o->val)
+			continue;
+		if (buf.len > 0)
+			appendStringInfoChar(&buf, ' ');
+		appendStringInfo(&buf, "%s='", o->keyword);
+		for (p = o->val; *p; p++)
+		{
+			if (*p == '\\' || *p == '\'')
+				appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, *p);
+		}
+		appendStringInfoChar(&buf, '\'');
+	}
+	PQconninfoFree(opts);
+
+	return buf.data;
+#else
+	return pstrdup(connect_str);
+#endif
+}
+
 /*
  * Get cached or create new fake cluster.
  */
@@ -1071,18 +1244,37 @@ fake_cluster(ProxyFunction *func, const char *connect_str)
 {
 	ProxyCluster *cluster;
 	MemoryContext old_ctx;
-	struct AANode *n;
+	struct StrHashNode *n;
+	FakeConnect *fc;
+	char	   *name;
 
 	/* search if cached */
-	n = aatree_search(&fake_cluster_tree, (uintptr_t)connect_str);
+	n = strhash_search(&fake_connect_hash, connect_str);
 	if (n)
 	{
-		cluster = container_of(n, ProxyCluster, node);
+		fc = container_of(n, FakeConnect, node);
+		if (fc != fake_lru_head)
+		{
+			fake_lru_unlink(fc);
+			fake_lru_push(fc);
+		}
+		cluster = fc->cluster;
 		goto done;
 	}
 
+	fake_connect_evict();
+
+	/* maybe other string for same database is known */
+	name = normalize_connstr(connect_str);
+	n = strhash_search(&fake_cluster_hash, name);
+	if (n)
+	{
+		cluster = container_of(n, ProxyCluster, node);
+		goto found;
+	}
+
 	/* create if not */
-	cluster = new_cluster(connect_str);
+	cluster = new_cluster(name);
 
 	old_ctx = MemoryContextSwitchTo(cluster_mem);
 
@@ -1090,14 +1282,23 @@ fake_cluster(ProxyFunction *func, const char *connect_str)
 	cluster->version = 1;
 	cluster->part_count = 1;
 	cluster->part_mask = 0;
-	cluster->part_map = palloc(cluster->part_count * sizeof(ProxyConnection *));
-	cluster->active_list = palloc(cluster->part_count * sizeof(ProxyConnection *));
+	cluster->part_map = palloc(cluster->part_count * sizeof(ProxyDatabase *));
 
 	MemoryContextSwitchTo(old_ctx);
 
-	add_connection(cluster, connect_str, 0);
+	add_connection(cluster, cluster->name, 0);
+
+	strhash_insert(&fake_cluster_hash, cluster->name, &cluster->node);
+
+found:
+	pfree(name);
 
-	aatree_insert(&fake_cluster_tree, (uintptr_t)connect_str, &cluster->node);
+	fc = MemoryContextAllocZero(cluster_mem, sizeof(*fc));
+	fc->connect_str = MemoryContextStrdup(cluster_mem, connect_str);
+	fc->cluster = cluster;
+	cluster->fake_refs++;
+	strhash_insert(&fake_connect_hash, fc->connect_str, &fc->node);
+	fake_lru_push(fc);
 
 done:
 	refresh_cluster(func, cluster);
@@ -1132,6 +1333,29 @@ resolve_query(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *query)
 	return name;
 }
 
+/*
+ * Call resolve function, with result cached if requested
+ * by CACHE CLUSTER or CACHE CONNECT.
+ */
+static const char *
+resolve_query_cached(ProxyFunction *func, FunctionCallInfo fcinfo,
+					 ProxyQuery *query, char kind, int ttl)
+{
+	StringInfo	key;
+	const char *name;
+
+	if (ttl <= 0)
+		return resolve_query(func, fcinfo, query);
+
+	name = plproxy_cache_resolved_lookup(func, fcinfo, query, kind, &key);
+	if (name)
+		return name;
+
+	name = resolve_query(func, fcinfo, query);
+	plproxy_cache_resolved_store(func, key, name, ttl);
+	return name;
+}
+
 /*
  * Find cached cluster of create new one.
  *
@@ -1143,13 +1367,14 @@ plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo)
 {
 	ProxyCluster *cluster = NULL;
 	const char *name;
-	struct AANode *node;
+	struct StrHashNode *node;
 
 
 	/* functions used CONNECT with query */
 	if (func->connect_sql) {
 		const char *cstr;
-		cstr = resolve_query(func, fcinfo, func->connect_sql);
+		cstr = resolve_query_cached(func, fcinfo, func->connect_sql,
+									'N', func->connect_cache_ttl);
 		return fake_cluster(func, cstr);
 	}
 
@@ -1158,14 +1383,23 @@ plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo)
 	if (func->connect_str)
 		return fake_cluster(func, func->connect_str);
 
+	/* literal cluster name, already resolved */
+	if (func->cached_cluster)
+	{
+		cluster = func->cached_cluster;
+		refresh_cluster(func, cluster);
+		return cluster;
+	}
+
 	/* Cluster statement, either a lookup function or a name */
 	if (func->cluster_sql)
-		name = resolve_query(func, fcinfo, func->cluster_sql);
+		name = resolve_query_cached(func, fcinfo, func->cluster_sql,
+									'C', func->cluster_cache_ttl);
 	else
 		name = func->cluster_name;
 
 	/* search if cached */
-	node = aatree_search(&cluster_tree, (uintptr_t)name);
+	node = strhash_search(&cluster_hash, name);
 	if (node)
 		cluster = container_of(node, ProxyCluster, node);
 
@@ -1174,9 +1408,13 @@ plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo)
 	{
 		cluster = new_cluster(name);
 		cluster->needs_reload = true;
-		aatree_insert(&cluster_tree, (uintptr_t)name, &cluster->node);
+		strhash_insert(&cluster_hash, cluster->name, &cluster->node);
 	}
 
+	/* clusters are never freed, so pointer can be kept */
+	if (!func->cluster_sql)
+		func->cached_cluster = cluster;
+
 	/* determine cluster type, reload parts if necessary */
 	refresh_cluster(func, cluster);
 
@@ -1184,36 +1422,68 @@ plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo)
 }
 
 /*
- * Move connection to active list and init current
- * connection state.
+ * Add database connection to call's active list and
+ * pick free connection state for it.
  */
-void plproxy_activate_connection(struct ProxyConnection *conn)
+ProxyConnection *
+plproxy_activate_connection(ProxyExec *exec, ProxyDatabase *db)
 {
-	ProxyCluster *cluster = conn->cluster;
-	ConnUserInfo *userinfo = cluster->cur_userinfo;
-	const char *username = userinfo->username;
-	struct AANode *node;
+	ConnUserInfo *userinfo = exec->userinfo;
+	struct StrHashNode *node;
 	ProxyConnectionState *cur;
+	ProxyConnection *conn;
+	int			n;
+
+	conn = MemoryContextAllocZero(exec->ctx, sizeof(*conn));
+	conn->cluster = exec->cluster;
+	conn->exec = exec;
+	conn->database = db;
+	conn->connstr = db->connstr;
+
+	/* parameter arrays, sized for the query of this call */
+	n = exec->query->arg_count;
+	conn->param_values = MemoryContextAllocZero(exec->ctx, n * sizeof(char *));
+	conn->param_lengths = MemoryContextAllocZero(exec->ctx, n * sizeof(int));
+	conn->param_formats = MemoryContextAllocZero(exec->ctx, n * sizeof(int));
 
 	/* move connection to active_list */
-	cluster->active_list[cluster->active_count] = conn;
-	cluster->active_count++;
+	exec->conn_map[db->index] = conn;
+	exec->active_list[exec->active_count] = conn;
+	exec->active_count++;
 
-	/* fill ->cur pointer */
+	/* find state, usually same user as last time */
+	cur = db->last_state;
+	if (!cur || cur->userinfo != userinfo)
+	{
+		node = strhash_search(&db->userstate_hash, userinfo->username);
+		if (node) {
+			cur = container_of(node, ProxyConnectionState, node);
+		} else {
+			cur = MemoryContextAllocZero(cluster_mem, sizeof(*cur));
+			cur->userinfo = userinfo;
+			strhash_insert(&db->userstate_hash, userinfo->username, &cur->node);
+		}
+		db->last_state = cur;
+	}
 
-	node = aatree_search(&conn->userstate_tree, (uintptr_t)username);
-	if (node) {
-		cur = container_of(node, ProxyConnectionState, node);
-	} else {
-		cur = MemoryContextAllocZero(cluster_mem, sizeof(*cur));
-		cur->userinfo = userinfo;
-		aatree_insert(&conn->userstate_tree, (uintptr_t)username, &cur->node);
+	/* used by another call in progress, take extra connection */
+	while (cur->owner)
+	{
+		if (!cur->next)
+		{
+			cur->next = MemoryContextAllocZero(cluster_mem, sizeof(*cur));
+			cur->next->userinfo = userinfo;
+		}
+		cur = cur->next;
 	}
+
+	cur->owner = conn;
 	conn->cur = cur;
+	return conn;
 }
 
 /*
- * Clean old connections and results from all clusters.
+ * Clean old connections from all clusters.
  */
 
 struct MaintInfo {
@@ -1221,17 +1491,16 @@ struct MaintInfo {
 	struct timeval *now;
 };
 
-static void clean_state(struct AANode *node, void *arg)
+static void clean_one_state(ProxyConnectionState *cur, struct MaintInfo *maint)
 {
-	ProxyConnectionState *cur = container_of(node, ProxyConnectionState, node);
 	ConnUserInfo *uinfo = cur->userinfo;
-	struct MaintInfo *maint = arg;
 	ProxyConfig *cf = maint->cf;
 	struct timeval *now = maint->now;
 	time_t		age;
 	bool		drop;
 
-	if (!cur->db)
+	/* not connected or used by call in progress */
+	if (!cur->db || cur->owner)
 		return;
 
 	drop = false;
@@ -1243,50 +1512,90 @@ static void clean_state(struct AANode *node, void *arg)
 	{
 		drop = true;
 	}
-	else if (cf->connection_lifetime <= 0)
-	{
-		/* no aging */
-	}
 	else
 	{
-		age = now->tv_sec - cur->connect_time;
-		if (age >= cf->connection_lifetime)
-			drop = true;
+		if (cf->connection_lifetime > 0)
+		{
+			age = now->tv_sec - cur->connect_time;
+			if (age >= cf->connection_lifetime)
+				drop = true;
+		}
+		if (cf->idle_timeout > 0)
+		{
+			age = now->tv_sec - Max(cur->query_time, cur->connect_time);
+			if (age >= cf->idle_timeout)
+				drop = true;
+		}
 	}
 
 	if (drop)
 		plproxy_disconnect(cur);
 }
 
-static void clean_conn(struct AANode *node, void *arg)
+static void clean_state(struct StrHashNode *node, void *arg)
 {
-	ProxyConnection *conn = container_of(node, ProxyConnection, node);
-	struct MaintInfo *maint = arg;
+	ProxyConnectionState *cur = container_of(node, ProxyConnectionState, node);
 
-	if (conn->res)
-	{
-		PQclear(conn->res);
-		conn->res = NULL;
-	}
+	/* also extra connections */
+	for (; cur; cur = cur->next)
+		clean_one_state(cur, arg);
+}
+
+static void clean_conn(struct StrHashNode *node, void *arg)
+{
+	ProxyDatabase *db = container_of(node, ProxyDatabase, node);
 
-	aatree_walk(&conn->userstate_tree, AA_WALK_IN_ORDER, clean_state, maint);
+	strhash_walk(&db->userstate_hash, clean_state, arg);
 }
 
-static void clean_cluster(struct AANode *n, void *arg)
+/* where incremental maintenance continues */
+static struct MaintPos {
+	int			hash_nr;		/* 0 - clusters, 1 - fake clusters */
+	uint32		cluster_pos;	/* slot in cluster hash */
+	uint32		conn_pos;		/* slot in cluster's conn_hash */
+} maint_pos;
+
+/*
+ * Check at most budget connections, continuing from previous position.
+ *
+ * Returns true if there is more work left.
+ */
+bool
+plproxy_cluster_maint(struct timeval * now, int budget)
 {
-	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
+	struct StrHash *hashes[2] = { &cluster_hash, &fake_cluster_hash };
+	struct StrHashNode *n;
+	ProxyCluster *cluster;
 	struct MaintInfo maint;
 
-	maint.cf = &cluster->config;
-	maint.now = arg;
+	maint.now = now;
 
-	aatree_walk(&cluster->conn_tree, AA_WALK_IN_ORDER, clean_conn, &maint);
-}
+	while (maint_pos.hash_nr < 2)
+	{
+		n = strhash_next(hashes[maint_pos.hash_nr], &maint_pos.cluster_pos);
+		if (!n)
+		{
+			maint_pos.hash_nr++;
+			maint_pos.cluster_pos = 0;
+			continue;
+		}
 
-void
-plproxy_cluster_maint(struct timeval * now)
-{
-	aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, clean_cluster, now);
-	aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, clean_cluster, now);
+		cluster = container_of(n, ProxyCluster, node);
+		maint.cf = &cluster->config;
+		while ((n = strhash_next(&cluster->conn_hash, &maint_pos.conn_pos)) != NULL)
+		{
+			if (budget-- <= 0)
+				return true;
+			clean_conn(n, &maint);
+			maint_pos.conn_pos++;
+		}
+
+		maint_pos.cluster_pos++;
+		maint_pos.conn_pos = 0;
+	}
+
+	/* full round done */
+	memset(&maint_pos, 0, sizeof(maint_pos));
+	return false;
 }
 
@@ -62,6 +62,15 @@ static int geterrcode(void)
 }
 #endif
 
+/* Time in milliseconds */
+static int64
+time_ms(struct timeval * tv)
+{
+	return (int64) tv->tv_sec * 1000 + tv->tv_usec / 1000;
+}
+
+static void prepare_conn(ProxyFunction *func, ProxyConnection *conn);
+
 /* some error happened */
 static void
 conn_error(ProxyFunction *func, ProxyConnection *conn, const char *desc)
@@ -70,6 +79,29 @@ conn_error(ProxyFunction *func, ProxyConnection *conn, const char *desc)
 				  PQdb(conn->cur->db), desc, PQerrorMessage(conn->cur->db));
 }
 
+/*
+ * Sending query failed on connection that was open before
+ * current call, so it was probably closed by remote side
+ * meanwhile and the query was not accepted.  Reconnect,
+ * query will be sent again when connection is ready.
+ *
+ * Done only once per call, and only if enabled with
+ * retry_send cluster option.
+ */
+static bool
+retry_send(ProxyFunction *func, ProxyConnection *conn)
+{
+	if (!conn->cluster->config.retry_send)
+		return false;
+	if (!conn->reused || conn->cur->tuning)
+		return false;
+
+	elog(DEBUG1, "PL/Proxy: resending query on new connection");
+	plproxy_disconnect(conn->cur);
+	prepare_conn(func, conn);
+	return true;
+}
+
 /* Compare if major/minor match. Works on "MAJ.MIN.*" */
 static bool
 cmp_branch(const char *this, const char *that)
@@ -109,10 +141,82 @@ flush_connection(ProxyFunction *func, ProxyConnection *conn)
 		conn->cur->state = C_QUERY_WRITE;
 	else if (res == 0)
 		conn->cur->state = C_QUERY_READ;
-	else
+	else if (!retry_send(func, conn))
 		conn_error(func, conn, "PQflush");
 }
 
+#if HAVE_PQENTERPIPELINEMODE
+/*
+ * statement_timeout for partitions: time left until the nearest
+ * local deadline, plus grace.  0 means proxy has no limit.
+ *
+ * TIMEOUT counts from sending the query, which is now, local
+ * statement_timeout counts from start of the local statement.
+ */
+static int
+remote_statement_timeout(ProxyFunction *func)
+{
+	bool		limited = false;
+	int64		left = 0;
+
+	if (func->timeout_ms > 0)
+	{
+		left = func->timeout_ms;
+		limited = true;
+	}
+
+	if (StatementTimeout > 0)
+	{
+		long		secs;
+		int			usecs;
+		int64		stmt_left;
+
+		TimestampDifference(GetCurrentStatementStartTimestamp(),
+							GetCurrentTimestamp(), &secs, &usecs);
+		stmt_left = StatementTimeout - ((int64) secs * 1000 + usecs / 1000);
+		if (!limited || stmt_left < left)
+			left = stmt_left;
+		limited = true;
+	}
+
+	if (!limited)
+		return 0;
+
+	/* deadline passed, local cancel is coming */
+	if (left < 1)
+		left = 1;
+	return (int) left + PLPROXY_REMOTE_TIMEOUT_GRACE;
+}
+
+/*
+ * Let partition abandon the query by itself, in case cancel
+ * from proxy does not reach it.
+ *
+ * Starts pipeline with transaction-local statement_timeout,
+ * the query follows in same transaction and same packet.
+ * So there is no extra round trip and no session state left
+ * for poolers to hand to other clients.
+ */
+static bool
+send_remote_timeout(ProxyConnection *conn, int timeout)
+{
+	char		buf[32];
+	const char *values[1];
+
+	snprintf(buf, sizeof(buf), "%d", timeout);
+	values[0] = buf;
+
+	if (!PQenterPipelineMode(conn->cur->db))
+		return false;
+	if (!PQsendQueryParams(conn->cur->db,
+						   "select pg_catalog.set_config('statement_timeout', $1, true)",
+						   1, NULL, values, NULL, NULL, 0))
+		return false;
+	conn->timeout_pending = true;
+	return true;
+}
+#endif
+
 /*
  * Small sanity checking for new connections.
  *
@@ -182,12 +286,16 @@ send_query(ProxyFunction *func, ProxyConnection *conn,
 {
 	int			res;
 	struct timeval now;
-	ProxyQuery *q = func->remote_sql;
-	ProxyConfig *cf = &func->cur_cluster->config;
+	ProxyQuery *q = func->cur_exec->query;
+	ProxyConfig *cf = &func->cur_exec->cluster->config;
 	int			binary_result = 0;
+#if HAVE_PQENTERPIPELINEMODE
+	int			timeout;
+#endif
 
 	gettimeofday(&now, NULL);
 	conn->cur->query_time = now.tv_sec;
+	conn->query_start_ms = time_ms(&now);
 
 	tune_connection(func, conn);
 	if (conn->cur->tuning)
@@ -211,6 +319,12 @@ send_query(ProxyFunction *func, ProxyConnection *conn,
 
 	/* send query */
 	conn->cur->state = C_QUERY_WRITE;
+	conn->timeout_pending = false;
+#if HAVE_PQENTERPIPELINEMODE
+	timeout = remote_statement_timeout(func);
+	if (timeout > 0 && !send_remote_timeout(conn, timeout))
+		conn_error(func, conn, "PQsendQueryParams");
+#endif
 	res = PQsendQueryParams(conn->cur->db, q->sql, q->arg_count,
 							NULL,		/* paramTypes */
 							values,		/* paramValues */
@@ -218,7 +332,26 @@ send_query(ProxyFunction *func, ProxyConnection *conn,
 							pformats,	/* paramFormats */
 							binary_result);		/* resultformat, 0-text, 1-bin */
 	if (!res)
-		conn_error(func, conn, "PQsendQueryParams");
+	{
+		if (!retry_send(func, conn))
+			conn_error(func, conn, "PQsendQueryParams");
+		return;
+	}
+
+#if HAVE_PQENTERPIPELINEMODE
+	if (conn->timeout_pending && !PQpipelineSync(conn->cur->db))
+		conn_error(func, conn, "PQpipelineSync");
+#endif
+
+	/*
+	 * With result limits, receive rows one by one to count them early.
+	 * In pipeline it is enabled after statement_timeout result.
+	 */
+	conn->single_row = false;
+#if HAVE_PQSETSINGLEROWMODE
+	if (cf->max_result_rows > 0 || cf->max_result_bytes > 0)
+		conn->single_row = conn->timeout_pending || PQsetSingleRowMode(conn->cur->db);
+#endif
 
 	/* flush it down */
 	flush_connection(func, conn);
@@ -229,9 +362,7 @@ static bool
 check_old_conn(ProxyFunction *func, ProxyConnection *conn, struct timeval * now)
 {
 	time_t		t;
-	int			res;
-	struct pollfd	pfd;
-	ProxyConfig *cf = &func->cur_cluster->config;
+	ProxyConfig *cf = &func->cur_exec->cluster->config;
 
 	if (PQstatus(conn->cur->db) != CONNECTION_OK)
 		return false;
@@ -246,34 +377,109 @@ check_old_conn(ProxyFunction *func, ProxyConnection *conn, struct timeval * now)
 
 	/* how long ts been idle */
 	t = now->tv_sec - conn->cur->query_time;
-	if (t < PLPROXY_IDLE_CONN_CHECK)
-		return true;
+	if (cf->idle_timeout > 0 && t >= cf->idle_timeout)
+		return false;
 
-	/*
-	 * Simple way to check if old connection is stable - look if there
-	 * are events pending.  If there are drop the connection.
-	 */
-intr_loop:
-	pfd.fd = PQsocket(conn->cur->db);
-	pfd.events = POLLIN;
-	pfd.revents = 0;
+	/* pending events were checked in check_idle_conns() */
+	return true;
+}
 
-	res = poll(&pfd, 1, 0);
-	if (res > 0)
+/* poll() array shared between check_idle_conns() and poll_conns() */
+static struct pollfd *pfd_cache = NULL;
+static int pfd_allocated = 0;
+
+static struct pollfd *
+get_pollfd_cache(int count)
+{
+	if (pfd_allocated < count)
 	{
-		elog(WARNING, "PL/Proxy: detected unstable connection");
+		struct pollfd *tmp;
+		int num = count;
+		if (num < 64)
+			num = 64;
+		if (pfd_cache == NULL)
+			tmp = malloc(num * sizeof(struct pollfd));
+		else
+			tmp = realloc(pfd_cache, num * sizeof(struct pollfd));
+		if (!tmp)
+			elog(ERROR, "no mem for pollfd cache");
+		pfd_cache = tmp;
+		pfd_allocated = num;
+	}
+	return pfd_cache;
+}
+
+/* reused conn that has been idle long enough to need checking */
+static bool
+needs_idle_check(ProxyConnection *conn, struct timeval * now)
+{
+	if (!conn->run_tag)
+		return false;
+	if (conn->cur->state != C_READY && conn->cur->state != C_DONE)
+		return false;
+	if (PQstatus(conn->cur->db) != CONNECTION_OK)
 		return false;
+	return now->tv_sec - conn->cur->query_time >= PLPROXY_IDLE_CONN_CHECK;
+}
+
+/*
+ * Simple way to check if old connection is stable - look if there
+ * are events pending.  If there are drop the connection.
+ *
+ * All idle connections are checked with single poll() call,
+ * dropped ones are reconnected by prepare_conn().
+ */
+static void
+check_idle_conns(ProxyFunction *func, ProxyExec *exec, struct timeval * now)
+{
+	ProxyConnection *conn;
+	struct pollfd *pfd, *pf;
+	int			i,
+				res,
+				numfds = 0;
+
+	pfd = get_pollfd_cache(exec->active_count);
+	for (i = 0; i < exec->active_count; i++)
+	{
+		conn = exec->active_list[i];
+		if (!needs_idle_check(conn, now))
+			continue;
+
+		pf = pfd + numfds++;
+		pf->fd = PQsocket(conn->cur->db);
+		pf->events = POLLIN;
+		pf->revents = 0;
 	}
-	else if (res < 0)
+	if (numfds == 0)
+		return;
+
+intr_loop:
+	res = poll(pfd, numfds, 0);
+	if (res == 0)
+		return;
+	if (res < 0)
 	{
 		if (errno == EINTR)
 			goto intr_loop;
-		plproxy_error(func, "check_old_conn: select failed: %s",
+		plproxy_error(func, "check_idle_conns: poll failed: %s",
 					  strerror(errno));
 	}
 
-	/* seems ok */
-	return true;
+	/* same order as above */
+	pf = pfd;
+	for (i = 0; i < exec->active_count; i++)
+	{
+		conn = exec->active_list[i];
+		if (!needs_idle_check(conn, now))
+			continue;
+
+		if (pf->revents)
+		{
+			elog(WARNING, "PL/Proxy: detected unstable connection");
+			plproxy_disconnect(conn->cur);
+		}
+		pf++;
+	}
 }
 
 static bool
@@ -370,25 +576,37 @@ static void setup_keepalive(ProxyConnection *conn)
 static void
 handle_notice(void *arg, const PGresult *res)
 {
-	ProxyConnection *conn = arg;
-	ProxyCluster *cluster = conn->cluster;
-	plproxy_remote_error(cluster->cur_func, conn, res, false);
+	ProxyConnectionState *cur = arg;
+	ProxyConnection *conn = cur->owner;
+
+	/* notices come only while call is using the connection */
+	if (conn)
+		plproxy_remote_error(conn->exec->func, conn, res, false);
 }
 
 static const char *
 get_connstr(ProxyConnection *conn)
 {
 	StringInfoData cstr;
-	ConnUserInfo *info = conn->cluster->cur_userinfo;
-
-	if (strstr(conn->connstr, "user=") != NULL)
-		return pstrdup(conn->connstr);
+	ConnUserInfo *info = conn->exec->userinfo;
 
 	initStringInfo(&cstr);
-	if (info->extra_connstr)
-		appendStringInfo(&cstr, "%s %s", conn->connstr, info->extra_connstr);
-	else
-		appendStringInfo(&cstr, "%s user='%s'", conn->connstr, info->username);
+	appendStringInfoString(&cstr, conn->connstr);
+
+	if (strstr(conn->connstr, "user=") == NULL)
+	{
+		if (info->extra_connstr)
+			appendStringInfo(&cstr, " %s", info->extra_connstr);
+		else
+			appendStringInfo(&cstr, " user='%s'", info->username);
+	}
+
+#if PG_VERSION_NUM >= 90100
+	/* set encoding at startup, avoids SET query in tune_connection() */
+	if (strstr(conn->connstr, "client_encoding=") == NULL)
+		appendStringInfo(&cstr, " client_encoding='%s'", GetDatabaseEncodingName());
+#endif
+
 	return cstr.data;
 }
 
@@ -410,7 +628,10 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 			conn->cur->state = C_READY;
 		case C_READY:
 			if (check_old_conn(func, conn, &now))
+			{
+				conn->reused = true;
 				return;
+			}
 
 		case C_CONNECT_READ:
 		case C_CONNECT_WRITE:
@@ -424,6 +645,7 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 	}
 
 	conn->cur->connect_time = now.tv_sec;
+	conn->reused = false;
 
 	/* launch new connection */
 	connstr = get_connstr(conn);
@@ -438,11 +660,120 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 		conn_error(func, conn, "PQconnectStart");
 
 	/* override default notice handler */
-	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn);
+	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn->cur);
 
 	setup_keepalive(conn);
 }
 
+#if !HAVE_PQRESULTMEMORYSIZE
+/* Estimated memory used by one row of result */
+static int64
+row_size(const PGresult *res, int row)
+{
+	int			cols = PQnfields(res);
+	int64		size;
+	int			i;
+
+	size = sizeof(void *) + cols * (sizeof(int) + sizeof(char *));
+	for (i = 0; i < cols; i++)
+		size += PQgetlength(res, row, i) + 1;
+	return size;
+}
+#endif
+
+/*
+ * Memory used by result.  libpq allocates it with malloc(),
+ * so it is not seen in Postgres memory contexts.  Older libpq
+ * cannot report it, then it is estimated from value sizes.
+ */
+static int64
+result_size(const PGresult *res)
+{
+#if HAVE_PQRESULTMEMORYSIZE
+	return PQresultMemorySize(res);
+#else
+	int64		size = 0;
+	int			i;
+
+	for (i = 0; i < PQntuples(res); i++)
+		size += row_size(res, i);
+	return size;
+#endif
+}
+
+/*
+ * Stop the call when its results get too big.  Checked as each
+ * partition's result arrives, the error cancels the others.
+ */
+static void
+check_result_limits(ProxyFunction *func, ProxyExec *exec)
+{
+	ProxyConfig *cf = &exec->cluster->config;
+
+	if (cf->max_result_rows > 0 && exec->result_rows > cf->max_result_rows)
+		plproxy_error_with_state(func, ERRCODE_PROGRAM_LIMIT_EXCEEDED,
+								 "Result has more than %d rows, see max_result_rows",
+								 cf->max_result_rows);
+	if (cf->max_result_bytes > 0 && exec->result_bytes > cf->max_result_bytes)
+		plproxy_error_with_state(func, ERRCODE_PROGRAM_LIMIT_EXCEEDED,
+								 "Result is larger than " INT64_FORMAT " bytes, see max_result_bytes",
+								 cf->max_result_bytes);
+}
+
+#if HAVE_PQSETSINGLEROWMODE
+/*
+ * Append row received in single-row mode to connection result,
+ * so result limits are checked as rows arrive, not after whole
+ * result is buffered by libpq.
+ */
+static void
+add_single_row(ProxyFunction *func, ProxyConnection *conn, PGresult *res)
+{
+	ProxyExec  *exec = conn->exec;
+	int			row,
+				col;
+	bool		ok = true;
+#if HAVE_PQRESULTMEMORYSIZE
+	int64		old_size;
+#endif
+
+	if (!conn->res)
+	{
+		conn->res = PQcopyResult(res, PG_COPYRES_ATTRS);
+		if (!conn->res)
+		{
+			PQclear(res);
+			plproxy_error(func, "PQcopyResult failed");
+		}
+	}
+
+#if HAVE_PQRESULTMEMORYSIZE
+	old_size = PQresultMemorySize(conn->res);
+#endif
+
+	row = PQntuples(conn->res);
+	for (col = 0; ok && col < PQnfields(res); col++)
+	{
+		if (PQgetisnull(res, 0, col))
+			ok = PQsetvalue(conn->res, row, col, NULL, -1);
+		else
+			ok = PQsetvalue(conn->res, row, col, PQgetvalue(res, 0, col),
+							PQgetlength(res, 0, col));
+	}
+
+	exec->result_rows++;
+#if HAVE_PQRESULTMEMORYSIZE
+	exec->result_bytes += PQresultMemorySize(conn->res) - old_size;
+#else
+	exec->result_bytes += row_size(res, 0);
+#endif
+	PQclear(res);
+
+	if (!ok)
+		plproxy_error(func, "PQsetvalue failed");
+}
+#endif
+
 /*
  * Connection has a resultset avalable, fetch it.
  *
@@ -456,6 +787,28 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 
 	/* got one */
 	res = PQgetResult(conn->cur->db);
+#if HAVE_PQENTERPIPELINEMODE
+	if (res == NULL && conn->timeout_pending)
+	{
+		/* statement_timeout is set, query results come next */
+		conn->timeout_pending = false;
+		if (conn->single_row)
+			conn->single_row = PQsetSingleRowMode(conn->cur->db);
+		return true;
+	}
+	if (res == NULL && PQpipelineStatus(conn->cur->db) != PQ_PIPELINE_OFF)
+	{
+		/* query is done, wait for end of pipeline */
+		return true;
+	}
+	if (res && PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+	{
+		PQclear(res);
+		if (!PQexitPipelineMode(conn->cur->db))
+			conn_error(func, conn, "PQexitPipelineMode");
+		return true;
+	}
+#endif
 	if (res == NULL)
 	{
 		conn->cur->waitCancel = 0;
@@ -475,13 +828,34 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 
 	switch (PQresultStatus(res))
 	{
+#if HAVE_PQSETSINGLEROWMODE
+		case PGRES_SINGLE_TUPLE:
+			add_single_row(func, conn, res);
+			check_result_limits(func, conn->exec);
+			break;
+#endif
 		case PGRES_TUPLES_OK:
+			if (conn->timeout_pending)
+			{
+				/* result of statement_timeout setting */
+				PQclear(res);
+				break;
+			}
+			if (conn->res && conn->single_row)
+			{
+				/* rows were added one by one, this only ends the set */
+				PQclear(res);
+				break;
+			}
 			if (conn->res)
 			{
 				PQclear(res);
 				conn_error(func, conn, "double result?");
 			}
 			conn->res = res;
+			conn->exec->result_rows += PQntuples(res);
+			conn->exec->result_bytes += result_size(res);
+			check_result_limits(func, conn->exec);
 			break;
 		case PGRES_COMMAND_OK:
 			PQclear(res);
@@ -508,9 +882,10 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
  * Called when select() told that conn is avail for reading/writing.
  *
  * It should call postgres handlers and then change state if needed.
+ * If dispatch is set, query is sent as soon as connection gets ready.
  */
 static void
-handle_conn(ProxyFunction *func, ProxyConnection *conn)
+handle_conn(ProxyFunction *func, ProxyConnection *conn, bool dispatch)
 {
 	int			res;
 	PostgresPollingStatusType poll_res;
@@ -560,6 +935,62 @@ handle_conn(ProxyFunction *func, ProxyConnection *conn)
 		case C_READY:
 			break;
 	}
+
+	/* login or tuning finished, send query right away */
+	if (dispatch && conn->cur->state == C_READY)
+		send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+}
+
+/*
+ * Milliseconds until first connect or query timeout
+ * of tagged connections, at most 1000.
+ */
+static int
+poll_timeout(ProxyExec *exec, struct timeval * now)
+{
+	ProxyConfig *cf = &exec->cluster->config;
+	ProxyFunction *func = exec->func;
+	ProxyConnection *conn;
+	int			i,
+				timeout = 1000;
+	int64		deadline,
+				left;
+
+	for (i = 0; i < exec->active_count; i++)
+	{
+		conn = exec->active_list[i];
+		if (!conn->run_tag)
+			continue;
+
+		/* check_timeouts() fires only after limit is passed */
+		switch (conn->cur->state)
+		{
+			case C_CONNECT_READ:
+			case C_CONNECT_WRITE:
+				if (cf->connect_timeout <= 0)
+					continue;
+				deadline = (int64) (conn->cur->connect_time + cf->connect_timeout + 1) * 1000;
+				break;
+			case C_QUERY_READ:
+			case C_QUERY_WRITE:
+				if (func->timeout_ms > 0 && !conn->cur->waitCancel)
+				{
+					deadline = conn->query_start_ms + func->timeout_ms + 1;
+					break;
+				}
+				if (cf->query_timeout <= 0)
+					continue;
+				deadline = (int64) (conn->cur->query_time + cf->query_timeout + 1) * 1000;
+				break;
+			default:
+				continue;
+		}
+
+		left = deadline - time_ms(now);
+		if (left < timeout)
+			timeout = (left > 0) ? (int) left : 0;
+	}
+	return timeout;
 }
 
 /*
@@ -569,11 +1000,8 @@ handle_conn(ProxyFunction *func, ProxyConnection *conn)
  * on small number of sockets.
  */
 static int
-poll_conns(ProxyFunction *func, ProxyCluster *cluster)
+poll_conns(ProxyFunction *func, ProxyExec *exec, bool dispatch, int timeout)
 {
-	static struct pollfd *pfd_cache = NULL;
-	static int pfd_allocated = 0;
-
 	int			i,
 				res,
 				fd;
@@ -582,25 +1010,11 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	int numfds = 0;
 	int ev = 0;
 
-	if (pfd_allocated < cluster->active_count)
-	{
-		struct pollfd *tmp;
-		int num = cluster->active_count;
-		if (num < 64)
-			num = 64;
-		if (pfd_cache == NULL)
-			tmp = malloc(num * sizeof(struct pollfd));
-		else
-			tmp = realloc(pfd_cache, num * sizeof(struct pollfd));
-		if (!tmp)
-			elog(ERROR, "no mem for pollfd cache");
-		pfd_cache = tmp;
-		pfd_allocated = num;
-	}
+	get_pollfd_cache(exec->active_count);
 
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 		if (!conn->run_tag)
 			continue;
 
@@ -629,7 +1043,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	}
 
 	/* wait for events */
-	res = poll(pfd_cache, numfds, 1000);
+	res = poll(pfd_cache, numfds, timeout);
 	if (res == 0)
 		return 0;
 	if (res < 0)
@@ -641,9 +1055,9 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 
 	/* now recheck the conns */
 	pf = pfd_cache;
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 		if (!conn->run_tag)
 			continue;
 
@@ -668,7 +1082,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 			elog(WARNING, "fd order from poll() is messed up?");
 
 		if (pf->revents)
-			handle_conn(func, conn);
+			handle_conn(func, conn, dispatch);
 
 		pf++;
 	}
@@ -677,7 +1091,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 
 /* Check if some operation has gone over limit */
 static void
-check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn, time_t now)
+check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn, struct timeval * now)
 {
 	ProxyConfig *cf = &cluster->config;
 
@@ -687,16 +1101,23 @@ check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn
 		case C_CONNECT_WRITE:
 			if (cf->connect_timeout <= 0)
 				break;
-			if (now - conn->cur->connect_time <= cf->connect_timeout)
+			if (now->tv_sec - conn->cur->connect_time <= cf->connect_timeout)
 				break;
 			plproxy_error(func, "connect timeout to: %s", conn->connstr);
 			break;
 
 		case C_QUERY_READ:
 		case C_QUERY_WRITE:
+			/* function TIMEOUT overrides cluster one, remote query gets canceled */
+			if (func->timeout_ms > 0 && !conn->cur->waitCancel)
+			{
+				if (time_ms(now) - conn->query_start_ms > func->timeout_ms)
+					plproxy_error_with_state(func, ERRCODE_QUERY_CANCELED, "query timeout");
+				break;
+			}
 			if (cf->query_timeout <= 0)
 				break;
-			if (now - conn->cur->query_time <= cf->query_timeout)
+			if (now->tv_sec - conn->cur->query_time <= cf->query_timeout)
 				break;
 			plproxy_error(func, "query timeout");
 			break;
@@ -705,49 +1126,55 @@ check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn
 	}
 }
 
-/* Run the query on all tagged connections in parallel */
+/* Launch connections and send query on all tagged connections */
 static void
-remote_execute(ProxyFunction *func)
+remote_launch(ProxyFunction *func)
 {
-	ExecStatusType err;
 	ProxyConnection *conn;
-	ProxyCluster *cluster = func->cur_cluster;
-	int			i,
-				pending = 0;
+	ProxyExec  *exec = func->cur_exec;
+	int			i;
 	struct timeval now;
 
+	/* drop reused conns that have gone bad meanwhile */
+	gettimeofday(&now, NULL);
+	check_idle_conns(func, exec, &now);
+
 	/* either launch connection or send query */
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 		if (!conn->run_tag)
 			continue;
 
 		/* check if conn is alive, and launch if not */
 		prepare_conn(func, conn);
-		pending++;
 
 		/* if conn is ready, then send query away */
 		if (conn->cur->state == C_READY)
 			send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
 	}
+}
+
+/* Wait until results from all tagged connections have arrived */
+static void
+remote_wait(ProxyFunction *func)
+{
+	ExecStatusType err;
+	ProxyConnection *conn;
+	ProxyExec  *exec = func->cur_exec;
+	int			i,
+				pending = 1;
+	struct timeval now;
 
 	/* now loop until all results are arrived */
 	while (pending)
 	{
-		/* allow postgres to cancel processing */
-		CHECK_FOR_INTERRUPTS();
-
-		/* wait for events */
-		if (poll_conns(func, cluster) == 0)
-			continue;
-
 		/* recheck */
 		pending = 0;
 		gettimeofday(&now, NULL);
-		for (i = 0; i < cluster->active_count; i++)
+		for (i = 0; i < exec->active_count; i++)
 		{
-			conn = cluster->active_list[i];
+			conn = exec->active_list[i];
 			if (!conn->run_tag)
 				continue;
 
@@ -758,14 +1185,32 @@ remote_execute(ProxyFunction *func)
 			if (conn->cur->state != C_DONE)
 				pending++;
 
-			check_timeouts(func, cluster, conn, now.tv_sec);
+			check_timeouts(func, exec->cluster, conn, &now);
+		}
+		if (!pending)
+			break;
+
+		/* allow postgres to cancel processing */
+		CHECK_FOR_INTERRUPTS();
+
+		/* wait for events, until first timeout */
+		if (poll_conns(func, exec, true, poll_timeout(exec, &now)) == 0)
+		{
+			/* check timeouts also when nothing happened */
+			gettimeofday(&now, NULL);
+			for (i = 0; i < exec->active_count; i++)
+			{
+				conn = exec->active_list[i];
+				if (conn->run_tag)
+					check_timeouts(func, exec->cluster, conn, &now);
+			}
 		}
 	}
 
 	/* review results, calculate total */
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 
 		if ((conn->run_tag || conn->res)
 			&& !(conn->run_tag && conn->res))
@@ -784,7 +1229,7 @@ remote_execute(ProxyFunction *func)
 			plproxy_error(func, "Remote error: %s",
 						  PQresultErrorMessage(conn->res));
 
-		cluster->ret_total += PQntuples(conn->res);
+		exec->ret_total += PQntuples(conn->res);
 	}
 }
 
@@ -792,7 +1237,7 @@ static void
 remote_wait_for_cancel(ProxyFunction *func)
 {
 	ProxyConnection *conn;
-	ProxyCluster *cluster = func->cur_cluster;
+	ProxyExec  *exec = func->cur_exec;
 	int			i,
 				pending;
 	struct timeval now;
@@ -806,27 +1251,27 @@ remote_wait_for_cancel(ProxyFunction *func)
 		/* recheck */
 		pending = 0;
 		gettimeofday(&now, NULL);
-		for (i = 0; i < cluster->active_count; i++)
+		for (i = 0; i < exec->active_count; i++)
 		{
-			conn = cluster->active_list[i];
+			conn = exec->active_list[i];
 			if (!conn->run_tag)
 				continue;
 
 			if (conn->cur->state == C_QUERY_READ)
 				pending++;
-			check_timeouts(func, cluster, conn, now.tv_sec);
+			check_timeouts(func, exec->cluster, conn, &now);
 		}
 		if (!pending)
 			break;
 
 		/* wait for events */
-		poll_conns(func, cluster);
+		poll_conns(func, exec, false, 1000);
 	}
 
 	/* review results, calculate total */
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 
 		if (!conn->run_tag)
 			continue;
@@ -845,18 +1290,15 @@ static void
 remote_cancel(ProxyFunction *func)
 {
 	ProxyConnection *conn;
-	ProxyCluster *cluster = func->cur_cluster;
+	ProxyExec  *exec = func->cur_exec;
 	PGcancel *cancel;
 	char errbuf[256];
 	int ret;
 	int i;
 
-	if (cluster == NULL)
-		return;
-
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 		switch (conn->cur->state)
 		{
 			case C_NONE:
@@ -892,12 +1334,13 @@ remote_cancel(ProxyFunction *func)
  * Tag & move tagged connections to active list
  */
 
-static void tag_part(struct ProxyCluster *cluster, int i, int tag)
+static void tag_part(ProxyExec *exec, int i, int tag)
 {
-	ProxyConnection *conn = cluster->part_map[i];
+	ProxyDatabase *db = exec->cluster->part_map[i];
+	ProxyConnection *conn = exec->conn_map[db->index];
 
-	if (!conn->run_tag)
-		plproxy_activate_connection(conn);
+	if (!conn)
+		conn = plproxy_activate_connection(exec, db);
 
 	conn->run_tag = tag;
 }
@@ -914,11 +1357,38 @@ tag_hash_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 	int			i;
 	TupleDesc	desc;
 	Oid			htype;
-	ProxyCluster *cluster = func->cur_cluster;
+	ProxyExec  *exec = func->cur_exec;
+	ProxyCluster *cluster = exec->cluster;
+	ProxyResultRows *cached = NULL;
+	StringInfo	cache_key = NULL;
+
+	/*
+	 * Try hash cache.  Split rows are not cached, as one call
+	 * could flush the whole shared cache.
+	 */
+	if (func->run_cache_ttl > 0 && !array_params)
+	{
+		cached = plproxy_cache_hash_lookup(func, fcinfo, &cache_key);
+		if (cached)
+		{
+			for (i = 0; i < cached->nrows; i++)
+				tag_part(exec, DatumGetInt32(cached->values[i]) & cluster->part_mask, tag);
+			return;
+		}
+		cached = palloc(sizeof(*cached));
+		cached->nrows = 0;
+		cached->values = NULL;
+		cached->nulls = NULL;
+		cached->by_value = true;
+		cached->typlen = sizeof(int32);
+	}
 
 	/* execute cached plan */
 	plproxy_query_exec(func, fcinfo, func->hash_sql, array_params, array_row);
 
+	/* hash function may have called this function again */
+	func->cur_exec = exec;
+
 	/* get header */
 	desc = SPI_tuptable->tupdesc;
 	htype = SPI_gettypeid(desc, 1);
@@ -943,8 +1413,19 @@ tag_hash_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 		else
 			plproxy_error(func, "Hash result must be int2, int4 or int8");
 
+		if (cached)
+		{
+			if (i == 0)
+			{
+				cached->values = palloc(SPI_processed * sizeof(Datum));
+				cached->nulls = palloc0(SPI_processed * sizeof(bool));
+			}
+			cached->values[i] = Int32GetDatum(hashval);
+			cached->nrows++;
+		}
+
 		hashval &= cluster->part_mask;
-		tag_part(cluster, hashval, tag);
+		tag_part(exec, hashval, tag);
 	}
 
 	/* sanity check */
@@ -952,6 +1433,10 @@ tag_hash_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 		if (!fcinfo->flinfo->fn_retset)
 			plproxy_error(func, "Only set-returning function"
 						  " allows hashcount <> 1");
+
+	if (cached)
+		plproxy_cache_store(func->oid, cache_key->data, cache_key->len,
+							func->run_cache_ttl, cached);
 }
 
 /*
@@ -976,16 +1461,13 @@ make_datum_array(ProxyFunction *func, ArrayType *v, ProxyType *array_type)
 /*
  * Evaluate the run condition. Tag the matching connections with the specified
  * tag.
- *
- * Note that we don't allow nested plproxy calls on the same cluster (ie.
- * remote hash functions). The cluster and connection state are global and
- * would easily get messed up.
  */
 static void
 tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 					  DatumArray **array_params, int array_row)
 {
-	ProxyCluster   *cluster = func->cur_cluster;
+	ProxyExec	   *exec = func->cur_exec;
+	ProxyCluster   *cluster = exec->cluster;
 	int				i;
 
 	switch (func->run_type)
@@ -995,17 +1477,17 @@ tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 			break;
 		case R_ALL:
 			for (i = 0; i < cluster->part_count; i++)
-				tag_part(cluster, i, tag);
+				tag_part(exec, i, tag);
 			break;
 		case R_EXACT:
 			i = func->exact_nr;
 			if (i < 0 || i >= cluster->part_count)
 				plproxy_error(func, "part number out of range");
-			tag_part(cluster, i, tag);
+			tag_part(exec, i, tag);
 			break;
 		case R_ANY:
 			i = random() & cluster->part_mask;
-			tag_part(cluster, i, tag);
+			tag_part(exec, i, tag);
 			break;
 		default:
 			plproxy_error(func, "uninitialized run_type");
@@ -1017,17 +1499,18 @@ tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
  * per-partition split array parameters.
  *
  * This is done by looping over all of the split arrays side-by-side, for each
- * tuple see if it satisfies the RUN ON condition. If so, copy the tuple
- * to the partition's private array parameters.
+ * tuple see if it satisfies the RUN ON condition. If so, remember the tuple
+ * index in the partition's split_rows.  The actual array parameters are
+ * built from the deconstructed arrays in prepare_query_parameters().
  */
 static void
-prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo)
+prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo,
+						   DatumArray **arrays_to_split)
 {
-	int					i, row, col;
+	int					i, row;
 	int					split_array_len = -1;
 	int					split_array_count = 0;
-	ProxyCluster	   *cluster = func->cur_cluster;
-	DatumArray		   *arrays_to_split[FUNC_MAX_ARGS];
+	ProxyExec		   *exec = func->cur_exec;
 
 	/*
 	 * See if we have any arrays to split. If so, make them manageable by
@@ -1084,52 +1567,29 @@ prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo)
 		 */
 		tag_run_on_partitions(func, fcinfo, my_tag, arrays_to_split, row);
 
-		/* Add the array elements to the partitions tagged in previous step */
-		for (part = 0; part < cluster->active_count; part++)
+		/* Remember the row in the partitions tagged in previous step */
+		for (part = 0; part < exec->active_count; part++)
 		{
-			ProxyConnection	   *conn = cluster->active_list[part];
+			ProxyConnection	   *conn = exec->active_list[part];
 
 			if (conn->run_tag != my_tag)
 				continue;
 
-			if (!conn->bstate)
-				conn->bstate = palloc0(func->arg_count * sizeof(*conn->bstate));
-
-			/* Add this set of elements to the partition specific arrays */
-			for (col = 0; col < func->arg_count; col++)
+			if (conn->split_row_count >= conn->split_row_alloc)
 			{
-				if (!IS_SPLIT_ARG(func, col))
-					continue;
-
-				conn->bstate[col] = accumArrayResult(conn->bstate[col],
-													 arrays_to_split[col]->values[row],
-													 arrays_to_split[col]->nulls[row],
-													 arrays_to_split[col]->type->type_oid,
-													 CurrentMemoryContext);
+				if (!conn->split_rows)
+				{
+					conn->split_row_alloc = 64;
+					conn->split_rows = palloc(conn->split_row_alloc * sizeof(int));
+				}
+				else
+				{
+					conn->split_row_alloc *= 2;
+					conn->split_rows = repalloc(conn->split_rows,
+												conn->split_row_alloc * sizeof(int));
+				}
 			}
-		}
-	}
-
-	/*
-	 * Finally, copy the accumulated arrays to the actual connections
-	 * to be used as parameters.
-	 */
-	for (i = 0; i < cluster->active_count; i++)
-	{
-		ProxyConnection *conn = cluster->active_list[i];
-
-		if (!conn->run_tag)
-			continue;
-
-		conn->split_params = palloc(func->arg_count * sizeof(*conn->split_params));
-
-		for (col = 0; col < func->arg_count; col++)
-		{
-			if (!IS_SPLIT_ARG(func, col))
-				conn->split_params[col] = PointerGetDatum(NULL);
-			else
-				conn->split_params[col] = makeArrayResult(conn->bstate[col],
-														  CurrentMemoryContext);
+			conn->split_rows[conn->split_row_count++] = row;
 		}
 	}
 }
@@ -1138,15 +1598,16 @@ prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo)
  * Prepare parameters for the query.
  */
 static void
-prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
+prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo,
+						 DatumArray **split_arrays)
 {
 	int				i;
-	ProxyCluster   *cluster = func->cur_cluster;
+	ProxyExec	   *exec = func->cur_exec;
 
-	for (i = 0; i < func->remote_sql->arg_count; i++)
+	for (i = 0; i < exec->query->arg_count; i++)
 	{
-		int			idx = func->remote_sql->arg_lookup[i];
-		bool		bin = cluster->config.disable_binary ? 0 : 1;
+		int			idx = exec->query->arg_lookup[i];
+		bool		bin = exec->cluster->config.disable_binary ? 0 : 1;
 		const char *fixed_param_val = NULL;
 		int			fixed_param_len, fixed_param_fmt;
 		int			part;
@@ -1162,9 +1623,9 @@ prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
 		}
 
 		/* Add the parameters to partitions */
-		for (part = 0; part < cluster->active_count; part++)
+		for (part = 0; part < exec->active_count; part++)
 		{
-			ProxyConnection *conn = cluster->active_list[part];
+			ProxyConnection *conn = exec->active_list[part];
 
 			if (!conn->run_tag)
 				continue;
@@ -1179,11 +1640,12 @@ prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
 			{
 				if (IS_SPLIT_ARG(func, idx))
 				{
-					conn->param_values[i] = plproxy_send_type(func->arg_types[idx],
-															  conn->split_params[idx],
-															  bin,
-															  &conn->param_lengths[i],
-															  &conn->param_formats[i]);
+					conn->param_values[i] = plproxy_send_split_array(split_arrays[idx],
+																	 conn->split_rows,
+																	 conn->split_row_count,
+																	 bin,
+																	 &conn->param_lengths[i],
+																	 &conn->param_formats[i]);
 				}
 				else
 				{
@@ -1196,38 +1658,47 @@ prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
 	}
 }
 
-/* Clean old results and prepare for new one */
-void
-plproxy_clean_results(ProxyCluster *cluster)
+/*
+ * Free results and give connections back.  Connections
+ * with query still in progress are dropped.
+ *
+ * Must not throw errors, used also at transaction end.
+ */
+static void
+exec_cleanup(ProxyExec *exec)
 {
 	int					i;
 	ProxyConnection	   *conn;
 
-	if (!cluster)
-		return;
-
-	cluster->ret_total = 0;
-	cluster->ret_cur_conn = 0;
+	exec->ret_total = 0;
+	exec->ret_cur_conn = 0;
+	exec->result_rows = 0;
+	exec->result_bytes = 0;
 
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < exec->active_count; i++)
 	{
-		conn = cluster->active_list[i];
+		conn = exec->active_list[i];
 		if (conn->res)
 		{
 			PQclear(conn->res);
 			conn->res = NULL;
 		}
-		conn->pos = 0;
+		if (conn->cur->owner == conn)
+		{
+			switch (conn->cur->state)
+			{
+				case C_NONE:
+				case C_READY:
+				case C_DONE:
+					break;
+				default:
+					plproxy_disconnect(conn->cur);
+					break;
+			}
+			conn->cur->owner = NULL;
+		}
 		conn->run_tag = 0;
-		conn->bstate = NULL;
-		conn->cur = NULL;
-		cluster->active_list[i] = NULL;
 	}
-
-	/* reset active_list */
-	cluster->active_count = 0;
-
-	/* conn state checks are done in prepare_conn */
 }
 
 /* Drop one connection */
@@ -1245,45 +1716,202 @@ void plproxy_disconnect(ProxyConnectionState *cur)
 	cur->waitCancel = 0;
 }
 
-/* Select partitions and execute query on them */
+/* Calls in progress, released at transaction end if not done before */
+static ProxyExec *exec_list = NULL;
+static bool exec_callback_registered = false;
+
+/* Result memory of last finished call */
+static int64 last_result_bytes = 0;
+
+static void
+exec_xact_callback(XactEvent event, void *arg)
+{
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT
+		&& event != XACT_EVENT_PREPARE)
+		return;
+
+	while (exec_list)
+		plproxy_exec_release(exec_list);
+}
+
+/* Allocate state for new call */
+static ProxyExec *
+exec_create(ProxyFunction *func, ProxyCluster *cluster)
+{
+	MemoryContext ctx;
+	ProxyExec  *exec;
+	int			n = cluster->db_count;
+
+	if (!exec_callback_registered)
+	{
+		RegisterXactCallback(exec_xact_callback, NULL);
+		exec_callback_registered = true;
+	}
+
+	ctx = AllocSetContextCreate(TopMemoryContext,
+								"PL/Proxy call context",
+								ALLOCSET_SMALL_MINSIZE,
+								ALLOCSET_SMALL_INITSIZE,
+								ALLOCSET_DEFAULT_MAXSIZE);
+	exec = MemoryContextAllocZero(ctx, sizeof(*exec));
+	exec->ctx = ctx;
+	exec->func = func;
+	exec->cluster = cluster;
+	exec->userinfo = cluster->cur_userinfo;
+	exec->conn_map = MemoryContextAllocZero(ctx, n * sizeof(ProxyConnection *));
+	exec->active_list = MemoryContextAllocZero(ctx, n * sizeof(ProxyConnection *));
+
+	exec->next = exec_list;
+	exec_list = exec;
+	cluster->exec_count++;
+	func->use_count++;
+
+	return exec;
+}
+
+/* Free results and state of call */
 void
-plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
+plproxy_exec_release(ProxyExec *exec)
+{
+	ProxyExec **p;
+
+	exec_cleanup(exec);
+
+	for (p = &exec_list; *p; p = &(*p)->next)
+	{
+		if (*p == exec)
+		{
+			*p = exec->next;
+			break;
+		}
+	}
+	exec->cluster->exec_count--;
+	plproxy_function_release(exec->func);
+
+	MemoryContextDelete(exec->ctx);
+}
+
+/*
+ * Release call state after failed execution, cancel remote
+ * queries if needed.
+ *
+ * Done immediately, so calls failing in a loop under
+ * exception handler do not pile up until transaction end.
+ */
+static void
+exec_failed(ProxyFunction *func)
 {
+	int			code = geterrcode();
+
+	/* stop queries on partitions too */
+	if (code == ERRCODE_QUERY_CANCELED || code == ERRCODE_PROGRAM_LIMIT_EXCEEDED)
+		remote_cancel(func);
+
+	/* plproxy_remote_error() cannot clean itself, do it here */
+	plproxy_exec_release(func->cur_exec);
+	func->cur_exec = NULL;
+}
+
+/*
+ * Select partitions and send query to them.
+ *
+ * Returned call state must be released with plproxy_exec_release().
+ * On error it is already released.
+ */
+ProxyExec *
+plproxy_exec_launch(ProxyFunction *func, ProxyCluster *cluster, FunctionCallInfo fcinfo)
+{
+	DatumArray *split_arrays[FUNC_MAX_ARGS];
+	ProxyExec  *exec;
+	MemoryContext old_ctx;
+
+	exec = exec_create(func, cluster);
+	func->cur_exec = exec;
+	exec->query = plproxy_remote_query(func, fcinfo);
+
 	/*
 	 * Prepare parameters and run query.  On cancel, send cancel request to
 	 * partitions too.
 	 */
+	old_ctx = CurrentMemoryContext;
 	PG_TRY();
 	{
-		func->cur_cluster->busy = true;
-		func->cur_cluster->cur_func = func;
-
-		/* clean old results */
-		plproxy_clean_results(func->cur_cluster);
+		/* parameters must stay around until query is sent */
+		MemoryContextSwitchTo(exec->ctx);
 
 		/* tag the partitions and prepare per-partition parameters */
-		prepare_and_tag_partitions(func, fcinfo);
+		prepare_and_tag_partitions(func, fcinfo, split_arrays);
 
 		/* prepare the target query parameters */
-		prepare_query_parameters(func, fcinfo);
+		prepare_query_parameters(func, fcinfo, split_arrays);
 
-		remote_execute(func);
+		MemoryContextSwitchTo(old_ctx);
 
-		func->cur_cluster->busy = false;
+		remote_launch(func);
 	}
 	PG_CATCH();
 	{
-		func->cur_cluster->busy = false;
+		/* exec->ctx is freed below */
+		MemoryContextSwitchTo(old_ctx);
+		exec_failed(func);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-		if (geterrcode() == ERRCODE_QUERY_CANCELED)
-			remote_cancel(func);
+	return exec;
+}
+
+/*
+ * Wait for results of launched query.
+ *
+ * Connections are given back, so other calls can use
+ * them while the results are processed.  On error the
+ * call state is released.
+ */
+void
+plproxy_exec_finish(ProxyExec *exec)
+{
+	ProxyFunction *func = exec->func;
+	ProxyConnection *conn;
+	int			i;
 
-		/* plproxy_remote_error() cannot clean itself, do it here */
-		plproxy_clean_results(func->cur_cluster);
+	func->cur_exec = exec;
 
+	PG_TRY();
+	{
+		remote_wait(func);
+	}
+	PG_CATCH();
+	{
+		exec_failed(func);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
+
+	for (i = 0; i < exec->active_count; i++)
+	{
+		conn = exec->active_list[i];
+		if (conn->cur->owner == conn)
+			conn->cur->owner = NULL;
+	}
+
+	last_result_bytes = exec->result_bytes;
 }
 
+/* Memory used by results of last finished call */
+int64
+plproxy_exec_last_result_bytes(void)
+{
+	return last_result_bytes;
+}
+
+/* Select partitions and execute query on them */
+ProxyExec *
+plproxy_exec(ProxyFunction *func, ProxyCluster *cluster, FunctionCallInfo fcinfo)
+{
+	ProxyExec  *exec;
 
+	exec = plproxy_exec_launch(func, cluster, fcinfo);
+	plproxy_exec_finish(exec);
+	return exec;
+}
@@ -53,6 +53,14 @@ static HTAB *fn_cache = NULL;
  */
 static ProxyFunction *partial_func = NULL;
 
+/*
+ * Replaced functions whose last call has been released.
+ *
+ * They are freed on next compile, not at transaction end
+ * where the calls are released.
+ */
+static ProxyFunction *free_list = NULL;
+
 
 
 /* Allocate memory in the function's context */
@@ -258,7 +266,8 @@ fn_new(HeapTuple proc_tuple)
 /*
  * Delete function and release all associated storage
  *
- * Function is also deleted from cache.
+ * Function is also deleted from cache.  If calls are still
+ * using it, storage is released after last of them.
  */
 static void
 fn_delete(ProxyFunction *func, bool in_cache)
@@ -266,10 +275,22 @@ fn_delete(ProxyFunction *func, bool in_cache)
 	if (in_cache)
 		fn_cache_delete(func);
 
+	/* cached results may not be valid anymore, purged already if replaced */
+	if (!func->replaced && (func->cache_ttl > 0 || func->cluster_cache_ttl > 0
+		|| func->connect_cache_ttl > 0 || func->run_cache_ttl > 0))
+		plproxy_cache_purge(func->oid);
+
+	if (func->use_count > 0)
+	{
+		func->replaced = true;
+		return;
+	}
+
 	/* free cached plans */
 	plproxy_query_freeplan(func->hash_sql);
 	plproxy_query_freeplan(func->cluster_sql);
 	plproxy_query_freeplan(func->connect_sql);
+	plproxy_query_freeplan(func->cache_key_sql);
 
 	/* release function storage */
 	MemoryContextDelete(func->ctx);
@@ -414,6 +435,7 @@ fn_get_return_type(ProxyFunction *func,
 			func->ret_composite = plproxy_composite_info(func, ret_tup);
 			natts = func->ret_composite->tupdesc->natts;
 			func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
+			func->result_map_valid = false;
 			break;
 		case TYPEFUNC_SCALAR:
 			func->ret_scalar = plproxy_find_type_info(func, ret_oid, 0);
@@ -451,21 +473,47 @@ fn_refresh_record(FunctionCallInfo fcinfo,
 	if (equalTupleDescs(tuple_current, tuple_cached))
 		return;
 
+	/* calls in progress read results via the cached data */
+	if (func->use_count > 0)
+		plproxy_error(func, "result type changed while previous calls are in progress");
+
 	/* move to function context */
 	old_ctx = MemoryContextSwitchTo(func->ctx);
 	tuple_current = CreateTupleDescCopy(tuple_current);
 	MemoryContextSwitchTo(old_ctx);
 
 	/* release old data */
+	if (func->cache_ttl > 0 || func->cluster_cache_ttl > 0
+		|| func->connect_cache_ttl > 0 || func->run_cache_ttl > 0)
+		plproxy_cache_purge(func->oid);
 	plproxy_free_composite(func->ret_composite);
 	pfree(func->result_map);
 	pfree(func->remote_sql);
+	if (func->result_map_names)
+		pfree(func->result_map_names);
+	if (func->result_map_types)
+		pfree(func->result_map_types);
+	func->result_map_names = NULL;
+	func->result_map_types = NULL;
+	func->result_map_nfields = 0;
+	while (func->null_variants)
+	{
+		ProxyQuery *pq = func->null_variants;
+
+		func->null_variants = pq->next;
+		pfree(pq->sql);
+		pfree(pq->arg_lookup);
+		pfree(pq->null_args);
+		pfree(pq);
+	}
 
 	/* construct new data */
 	func->ret_composite = plproxy_composite_info(func, tuple_current);
 	natts = func->ret_composite->tupdesc->natts;
 	func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
+	func->result_map_valid = false;
 	func->remote_sql = plproxy_standard_query(func, true);
+	func->null_variant_count = 0;
 }
 
 /*
@@ -510,6 +558,18 @@ plproxy_compile(FunctionCallInfo fcinfo,
 	if (f->dynamic_record && f->remote_sql)
 		plproxy_error(f, "SELECT statement not allowed for dynamic RECORD functions");
 
+	if (f->dynamic_record && f->cache_ttl > 0)
+		plproxy_error(f, "CACHE TTL not allowed for dynamic RECORD functions");
+
+	if (f->cache_op == CACHE_GET)
+	{
+		if (proc_struct->proretset)
+			plproxy_error(f, "CACHE GET requires non-SETOF function");
+		if (proc_struct->prorettype == RECORDOID
+			|| get_typtype(proc_struct->prorettype) == TYPTYPE_COMPOSITE)
+			plproxy_error(f, "CACHE GET requires scalar return type");
+	}
+
 	/* sanity check */
 	if (f->run_type == R_ALL && (fcinfo
 								 ? !fcinfo->flinfo->fn_retset
@@ -536,6 +596,14 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 		partial_func = NULL;
 	}
 
+	/* free replaced functions that are not used anymore */
+	while (free_list)
+	{
+		f = free_list;
+		free_list = f->next_free;
+		fn_delete(f, false);
+	}
+
 	/* get current fn oid */
 	oid = fcinfo->flinfo->fn_oid;
 
@@ -560,7 +628,10 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 
 		/* create SELECT stmt if not specified */
 		if (f->remote_sql == NULL)
+		{
 			f->remote_sql = plproxy_standard_query(f, true);
+			f->remote_sql_generated = true;
+		}
 
 		/* prepare local queries */
 		if (f->cluster_sql)
@@ -569,6 +640,12 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 			plproxy_query_prepare(f, fcinfo, f->hash_sql, true);
 		if (f->connect_sql)
 			plproxy_query_prepare(f, fcinfo, f->connect_sql, false);
+		if (f->cache_key_sql)
+			plproxy_query_prepare(f, fcinfo, f->cache_key_sql, false);
+
+		/* CACHE GET stores results as text */
+		if (f->cache_op == CACHE_GET)
+			f->cache_out_type = plproxy_find_type_info(f, f->ret_scalar->type_oid, true);
 
 		fn_cache_insert(f);
 
@@ -590,3 +667,20 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 
 	return f;
 }
+
+/*
+ * Drop reference taken by call.
+ *
+ * Must not throw errors, used also at transaction end.
+ */
+void
+plproxy_function_release(ProxyFunction *func)
+{
+	Assert(func->use_count > 0);
+
+	if (--func->use_count == 0 && func->replaced)
+	{
+		func->next_free = free_list;
+		free_list = func;
+	}
+}
@@ -61,8 +61,6 @@ PG_FUNCTION_INFO_V1(plproxy_validator);
 
 /*
  * Centralised error reporting.
- *
- * Also frees any pending results.
  */
 void
 plproxy_error_with_state(ProxyFunction *func, int sqlstate, const char *fmt, ...)
@@ -74,8 +72,6 @@ plproxy_error_with_state(ProxyFunction *func, int sqlstate, const char *fmt, ...
 	vsnprintf(msg, sizeof(msg), fmt, ap);
 	va_end(ap);
 
-	plproxy_clean_results(func->cur_cluster);
-
 	ereport(ERROR, (
 		errcode(sqlstate),
 		errmsg("PL/Proxy function %s(%d): %s",
@@ -127,7 +123,7 @@ plproxy_remote_error(ProxyFunction *func, ProxyConnection *conn, const PGresult
  */
 static bool initialized = false;
 
-static void
+void
 plproxy_startup_init(void)
 {
 	if (initialized)
@@ -135,6 +131,7 @@ plproxy_startup_init(void)
 
 	plproxy_function_cache_init();
 	plproxy_cluster_cache_init();
+	plproxy_cache_init();
 	plproxy_syscache_callback_init();
 
 	initialized = true;
@@ -142,35 +139,54 @@ plproxy_startup_init(void)
 
 /*
  * Regular maintenance over all clusters.
+ *
+ * Started after each PLPROXY_MAINT_PERIOD, then spread
+ * over following calls, so no single call pays for all
+ * connections.
  */
 static void
 run_maint(void)
 {
 	static struct timeval last = {0, 0};
+	static bool in_progress = false;
 	struct timeval now;
 
 	if (!initialized)
 		return;
 
 	gettimeofday(&now, NULL);
-	if (now.tv_sec - last.tv_sec < 2 * 60)
-		return;
-	last = now;
+	if (!in_progress)
+	{
+		if (now.tv_sec - last.tv_sec < PLPROXY_MAINT_PERIOD)
+			return;
+		last = now;
+	}
 
-	plproxy_cluster_maint(&now);
+	in_progress = plproxy_cluster_maint(&now, PLPROXY_MAINT_BUDGET);
 }
 
 /*
  * Do compilation and execution under SPI.
  *
  * Result conversion will be done without SPI.
+ *
+ * For functions with CACHE TTL or CACHE GET the results are taken
+ * from cache or stored there, and returned in *cached, allocated
+ * in rows_ctx.  Otherwise *cached is set to NULL and the results
+ * are in *exec, which caller must release.
  */
 static ProxyFunction *
-compile_and_execute(FunctionCallInfo fcinfo)
+compile_and_execute(FunctionCallInfo fcinfo, MemoryContext rows_ctx,
+					ProxyResultRows **cached, ProxyExec **exec)
 {
 	int			err;
 	ProxyFunction *func;
 	ProxyCluster *cluster;
+	StringInfo	cache_key = NULL;
+	MemoryContext old_ctx;
+
+	*cached = NULL;
+	*exec = NULL;
 
 	/* prepare SPI */
 	err = SPI_connect();
@@ -183,25 +199,74 @@ compile_and_execute(FunctionCallInfo fcinfo)
 	/* compile code */
 	func = plproxy_compile_and_cache(fcinfo);
 
-	/* get actual cluster to run on */
-	cluster = plproxy_find_cluster(func, fcinfo);
+	/* try result cache */
+	if (func->cache_ttl > 0 || func->cache_op == CACHE_GET)
+	{
+		old_ctx = MemoryContextSwitchTo(rows_ctx);
+		*cached = plproxy_cache_call_lookup(func, fcinfo, &cache_key);
+		MemoryContextSwitchTo(old_ctx);
+	}
 
-	/* Don't allow nested calls on the same cluster */
-	if (cluster->busy)
-		plproxy_error(func, "Nested PL/Proxy calls to the same cluster are not supported.");
+	if (*cached == NULL)
+	{
+		/* get actual cluster to run on */
+		cluster = plproxy_find_cluster(func, fcinfo);
 
-	/* fetch PGresults */
-	func->cur_cluster = cluster;
-	plproxy_exec(func, fcinfo);
+		/* fetch PGresults */
+		*exec = plproxy_exec(func, cluster, fcinfo);
+
+		/* CACHE SET/INVALIDATE */
+		if (func->cache_op == CACHE_SET || func->cache_op == CACHE_INVALIDATE)
+			plproxy_cache_call_update(func, fcinfo);
+	}
 
 	/* done with SPI */
 	err = SPI_finish();
 	if (err != SPI_OK_FINISH)
 		elog(ERROR, "SPI_finish: %s", SPI_result_code_string(err));
 
+	/* remember fresh results */
+	if (cache_key && *cached == NULL)
+	{
+		old_ctx = MemoryContextSwitchTo(rows_ctx);
+		*cached = plproxy_cache_call_fill(func, fcinfo, cache_key);
+		MemoryContextSwitchTo(old_ctx);
+
+		/* results were moved to cache */
+		if (*cached)
+		{
+			plproxy_exec_release(*exec);
+			*exec = NULL;
+		}
+	}
+
 	return func;
 }
 
+/*
+ * State for set-returning calls.
+ */
+typedef struct RetSetState
+{
+	ProxyFunction *func;
+	ProxyExec  *exec;			/* remote results, if not cached */
+	ProxyResultRows *cached;	/* rows from result cache, if used */
+	ExprContext *econtext;		/* for shutdown callback */
+} RetSetState;
+
+/*
+ * Release results when set is not read to the end.
+ */
+static void
+ret_set_shutdown(Datum arg)
+{
+	RetSetState *state = (RetSetState *) DatumGetPointer(arg);
+
+	if (state->exec)
+		plproxy_exec_release(state->exec);
+	state->exec = NULL;
+}
+
 /*
  * Logic for set-returning functions.
  *
@@ -211,26 +276,55 @@ compile_and_execute(FunctionCallInfo fcinfo)
 static Datum
 handle_ret_set(FunctionCallInfo fcinfo)
 {
-	ProxyFunction *func;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	FuncCallContext *ret_ctx;
+	RetSetState *state;
+	ProxyResultRows *rows;
+	int			row;
 
 	if (SRF_IS_FIRSTCALL())
 	{
-		func = compile_and_execute(fcinfo);
 		ret_ctx = SRF_FIRSTCALL_INIT();
-		ret_ctx->user_fctx = func;
+		state = MemoryContextAllocZero(ret_ctx->multi_call_memory_ctx,
+									   sizeof(*state));
+		state->func = compile_and_execute(fcinfo,
+										  ret_ctx->multi_call_memory_ctx,
+										  &state->cached, &state->exec);
+		ret_ctx->user_fctx = state;
+
+		if (state->exec && rsinfo && IsA(rsinfo, ReturnSetInfo))
+		{
+			state->econtext = rsinfo->econtext;
+			RegisterExprContextCallback(state->econtext, ret_set_shutdown,
+										PointerGetDatum(state));
+		}
 	}
 
 	ret_ctx = SRF_PERCALL_SETUP();
-	func = ret_ctx->user_fctx;
+	state = ret_ctx->user_fctx;
+	rows = state->cached;
+
+	if (rows)
+	{
+		if (ret_ctx->call_cntr < rows->nrows)
+		{
+			row = ret_ctx->call_cntr;
+			fcinfo->isnull = rows->nulls[row];
+			SRF_RETURN_NEXT(ret_ctx, rows->values[row]);
+		}
+		SRF_RETURN_DONE(ret_ctx);
+	}
 
-	if (func->cur_cluster->ret_total > 0)
+	if (state->exec->ret_total > 0)
 	{
-		SRF_RETURN_NEXT(ret_ctx, plproxy_result(func, fcinfo));
+		SRF_RETURN_NEXT(ret_ctx, plproxy_result(state->exec, fcinfo));
 	}
 	else
 	{
-		plproxy_clean_results(func->cur_cluster);
+		if (state->econtext)
+			UnregisterExprContextCallback(state->econtext, ret_set_shutdown,
+										  PointerGetDatum(state));
+		ret_set_shutdown(PointerGetDatum(state));
 		SRF_RETURN_DONE(ret_ctx);
 	}
 }
@@ -245,7 +339,10 @@ Datum
 plproxy_call_handler(PG_FUNCTION_ARGS)
 {
 	ProxyFunction *func;
+	ProxyResultRows *cached;
+	ProxyExec  *exec;
 	Datum		ret;
+	int			total;
 
 	if (CALLED_AS_TRIGGER(fcinfo))
 		elog(ERROR, "PL/Proxy procedures can't be used as triggers");
@@ -260,14 +357,24 @@ plproxy_call_handler(PG_FUNCTION_ARGS)
 	}
 	else
 	{
-		func = compile_and_execute(fcinfo);
-		if (func->cur_cluster->ret_total != 1)
+		func = compile_and_execute(fcinfo, CurrentMemoryContext, &cached, &exec);
+		if (cached)
+		{
+			/* only single-row results are cached */
+			fcinfo->isnull = cached->nulls[0];
+			return cached->values[0];
+		}
+		total = exec->ret_total;
+		if (total != 1)
+		{
+			plproxy_exec_release(exec);
 			plproxy_error_with_state(func,
-				(func->cur_cluster->ret_total < 1) ? ERRCODE_NO_DATA_FOUND : ERRCODE_TOO_MANY_ROWS,
+				(total < 1) ? ERRCODE_NO_DATA_FOUND : ERRCODE_TOO_MANY_ROWS,
 				"Non-SETOF function requires 1 row from remote query, got %d",
-					func->cur_cluster->ret_total);
-		ret = plproxy_result(func, fcinfo);
-		plproxy_clean_results(func->cur_cluster);
+					total);
+		}
+		ret = plproxy_result(exec, fcinfo);
+		plproxy_exec_release(exec);
 	}
 	return ret;
 }
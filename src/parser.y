@@ -33,21 +33,37 @@
 static ProxyFunction *xfunc;
 
 /* remember what happened */
-static int got_run, got_cluster, got_connect, got_split, got_target;
+static int got_run, got_cluster, got_connect, got_split, got_target, got_cache;
+static int got_cache_cluster, got_cache_connect, got_cache_run, got_cache_key, got_timeout;
 
 static QueryBuffer *cluster_sql;
 static QueryBuffer *select_sql;
 static QueryBuffer *hash_sql;
 static QueryBuffer *connect_sql;
+static QueryBuffer *cache_sql;
 
 /* points to one of the above ones */
 static QueryBuffer *cur_sql;
 
+/* CACHE key parsing state */
+static int cache_part, cache_depth;
+
+/* TIMEOUT value and milliseconds per unit */
+static int timeout_value, timeout_scale;
+
+static void cache_set_option(const char *opt);
+static void cache_key_start(const char *fncall);
+static void cache_key_token(int tok, const char *str);
+static void cache_key_finish(void);
+
 /* keep the resetting code together with variables */
 static void reset_parser_vars(void)
 {
-	got_run = got_cluster = got_connect = got_split = got_target = 0;
-	cur_sql = select_sql = cluster_sql = hash_sql = connect_sql = NULL;
+	got_run = got_cluster = got_connect = got_split = got_target = got_cache = 0;
+	got_cache_cluster = got_cache_connect = got_cache_run = got_cache_key = got_timeout = 0;
+	cur_sql = select_sql = cluster_sql = hash_sql = connect_sql = cache_sql = NULL;
+	cache_part = cache_depth = 0;
+	timeout_value = timeout_scale = 0;
 	xfunc = NULL;
 }
 
@@ -64,7 +80,8 @@ static void reset_parser_vars(void)
 
 %token <str> CONNECT CLUSTER RUN ON ALL ANY SELECT
 %token <str> IDENT NUMBER FNCALL SPLIT STRING
-%token <str> SQLIDENT SQLPART TARGET
+%token <str> SQLIDENT SQLPART SQLCHAR TARGET CACHE TIMEOUT
+%type <str> arg_ident
 
 %union
 {
@@ -75,7 +92,8 @@ static void reset_parser_vars(void)
 
 body: | body stmt ;
 
-stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt;
+stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt
+	| cache_stmt | timeout_stmt;
 
 connect_stmt: CONNECT connect_spec ';'	{
 					if (got_connect)
@@ -87,7 +105,7 @@ connect_stmt: CONNECT connect_spec ';'	{
 connect_spec: connect_func sql_token_list | connect_name | connect_direct 
 			;
 
-connect_direct:	IDENT	{	connect_sql = plproxy_query_start(xfunc, false);
+connect_direct:	arg_ident	{	connect_sql = plproxy_query_start(xfunc, false);
 						cur_sql = connect_sql;
 						plproxy_query_add_const(cur_sql, "select ");
 						if (!plproxy_query_add_ident(cur_sql, $1))
@@ -131,6 +149,94 @@ target_stmt: TARGET target_name ';' {
 target_name: IDENT { xfunc->target_name = plproxy_func_strdup(xfunc, $1); }
 		   ;
 
+cache_stmt: CACHE cache_spec ';' {
+							if (got_cache)
+								yyerror("Only one CACHE statement allowed");
+							got_cache = 1; }
+		  | CACHE CLUSTER cache_resolve_ttl NUMBER ';' {
+							if (got_cache_cluster)
+								yyerror("Only one CACHE CLUSTER statement allowed");
+							got_cache_cluster = 1;
+							xfunc->cluster_cache_ttl = atoi($4);
+							if (xfunc->cluster_cache_ttl <= 0)
+								yyerror("CACHE TTL must be positive"); }
+		  | CACHE CONNECT cache_resolve_ttl NUMBER ';' {
+							if (got_cache_connect)
+								yyerror("Only one CACHE CONNECT statement allowed");
+							got_cache_connect = 1;
+							xfunc->connect_cache_ttl = atoi($4);
+							if (xfunc->connect_cache_ttl <= 0)
+								yyerror("CACHE TTL must be positive"); }
+		  | CACHE RUN cache_resolve_ttl NUMBER ';' {
+							if (got_cache_run)
+								yyerror("Only one CACHE RUN statement allowed");
+							got_cache_run = 1;
+							xfunc->run_cache_ttl = atoi($4);
+							if (xfunc->run_cache_ttl <= 0)
+								yyerror("CACHE TTL must be positive"); }
+		  | CACHE cache_key_word cache_resolve_ttl NUMBER ';' {
+							if (got_cache_key)
+								yyerror("Only one CACHE KEY statement allowed");
+							got_cache_key = 1;
+							xfunc->cache_key_ttl = atoi($4);
+							if (xfunc->cache_key_ttl <= 0)
+								yyerror("CACHE TTL must be positive"); }
+		  ;
+
+cache_key_word: IDENT	{ if (pg_strcasecmp($1, "key") != 0)
+								yyerror("unknown CACHE option: %s", $1); }
+		  ;
+
+cache_resolve_ttl: IDENT	{ if (pg_strcasecmp($1, "ttl") != 0)
+								yyerror("unknown CACHE option: %s", $1); }
+				 ;
+
+timeout_stmt: TIMEOUT timeout_value timeout_unit ';' {
+							if (got_timeout)
+								yyerror("Only one TIMEOUT statement allowed");
+							got_timeout = 1;
+							if (timeout_value <= 0)
+								yyerror("TIMEOUT must be positive");
+							if (timeout_value > 24*60*60*1000 / timeout_scale)
+								yyerror("TIMEOUT must be at most one day");
+							xfunc->timeout_ms = timeout_value * timeout_scale; }
+			;
+
+timeout_value: NUMBER	{ timeout_value = atoi($1); }
+			 ;
+
+timeout_unit:			{ timeout_scale = 1000; }
+			| IDENT		{ if (pg_strcasecmp($1, "s") == 0)
+							timeout_scale = 1000;
+						  else if (pg_strcasecmp($1, "ms") == 0)
+							timeout_scale = 1;
+						  else
+							yyerror("unknown TIMEOUT unit: %s", $1); }
+			;
+
+cache_spec: cache_opt NUMBER	{ if (xfunc->cache_op != CACHE_NONE)
+									yyerror("CACHE key missing");
+								  xfunc->cache_ttl = atoi($2);
+								  if (xfunc->cache_ttl <= 0)
+									yyerror("CACHE TTL must be positive"); }
+		  | cache_opt cache_key cache_token_list	{ cache_key_finish(); }
+		  ;
+
+cache_opt: IDENT	{ cache_set_option($1); }
+		 ;
+
+cache_key: FNCALL	{ cache_key_start($1); }
+		 ;
+
+cache_token_list: cache_token
+				| cache_token_list cache_token
+				;
+
+cache_token: SQLPART	{ cache_key_token(SQLPART, $1); }
+		   | SQLCHAR	{ cache_key_token(SQLCHAR, $1); }
+		   | SQLIDENT	{ cache_key_token(SQLIDENT, $1); }
+		   ;
+
 split_stmt: SPLIT split_spec ';' {
 							if (got_split)
 								yyerror("Only one SPLIT statement allowed");
@@ -146,7 +252,7 @@ split_param_list: split_param
 			| split_param_list ',' split_param
 			;
 
-split_param: IDENT {
+split_param: arg_ident {
 				if (!plproxy_split_add_ident(xfunc, $1))
 					yyerror("invalid argument reference: %s", $1);
 			}
@@ -163,7 +269,7 @@ run_spec: hash_func sql_token_list	{ xfunc->run_type = R_HASH; }
 		| hash_direct				{ xfunc->run_type = R_HASH; }
 		;
 
-hash_direct: IDENT	{	hash_sql = plproxy_query_start(xfunc, false);
+hash_direct: arg_ident	{	hash_sql = plproxy_query_start(xfunc, false);
 						cur_sql = hash_sql;
 						plproxy_query_add_const(cur_sql, "select ");
 						if (!plproxy_query_add_ident(cur_sql, $1))
@@ -177,6 +283,9 @@ hash_func: FNCALL	{ hash_sql = plproxy_query_start(xfunc, false);
 	 				  plproxy_query_add_const(cur_sql, $1); }
 		 ;
 
+/* newer keywords may be argument names */
+arg_ident: IDENT | CACHE | TIMEOUT ;
+
 select_stmt: sql_start sql_token_list ';' ;
 
 sql_start: SELECT		{ if (select_sql)
@@ -189,12 +298,102 @@ sql_token_list: sql_token
 			  | sql_token_list sql_token
 		      ;
 sql_token: SQLPART		{ plproxy_query_add_const(cur_sql, $1); }
+		 | SQLCHAR		{ plproxy_query_add_const(cur_sql, $1); }
 		 | SQLIDENT		{ if (!plproxy_query_add_ident(cur_sql, $1))
 							yyerror("invalid argument reference: %s", $1); }
 		 ;
 
 %%
 
+/*
+ * CACHE statement helpers.
+ *
+ * Key arguments are turned into query "select (row(args))::text"
+ * and for CACHE SET the value is added as second column.
+ */
+static void cache_set_option(const char *opt)
+{
+	if (pg_strcasecmp(opt, "ttl") == 0)
+		xfunc->cache_op = CACHE_NONE;
+	else if (pg_strcasecmp(opt, "get") == 0)
+		xfunc->cache_op = CACHE_GET;
+	else if (pg_strcasecmp(opt, "set") == 0)
+		xfunc->cache_op = CACHE_SET;
+	else if (pg_strcasecmp(opt, "invalidate") == 0)
+		xfunc->cache_op = CACHE_INVALIDATE;
+	else
+		yyerror("unknown CACHE option: %s", opt);
+}
+
+static void cache_key_start(const char *fncall)
+{
+	char	   *name, *p;
+
+	if (xfunc->cache_op == CACHE_NONE)
+		yyerror("CACHE TTL requires number of seconds");
+
+	/* key name is case-insensitive, strip "(" */
+	name = plproxy_func_strdup(xfunc, fncall);
+	for (p = name; *p && *p != '(' && *p != ' ' && *p != '\t' && *p != '\n'; p++)
+		*p = pg_tolower((unsigned char) *p);
+	*p = 0;
+	xfunc->cache_key_name = name;
+
+	cache_sql = plproxy_query_start(xfunc, false);
+	cur_sql = cache_sql;
+	plproxy_query_add_const(cur_sql, "select (row(");
+	cache_part = 0;
+	cache_depth = 1;
+}
+
+static void cache_key_token(int tok, const char *str)
+{
+	if (cache_part == 0 && tok == SQLCHAR)
+	{
+		/* look for closing paren of key */
+		if (str[0] == '(')
+			cache_depth++;
+		else if (str[0] == ')' && --cache_depth == 0)
+		{
+			plproxy_query_add_const(cur_sql, "))::text");
+			cache_part = 1;
+			return;
+		}
+	}
+	else if (cache_part == 1)
+	{
+		if (tok == SQLPART && strcmp(str, " ") == 0)
+			return;
+		if (tok == SQLCHAR && str[0] == '=' && xfunc->cache_op == CACHE_SET)
+		{
+			plproxy_query_add_const(cur_sql, ", (");
+			cache_part = 2;
+			return;
+		}
+		yyerror("unexpected symbol after CACHE key: %s", str);
+	}
+
+	if (tok == SQLIDENT)
+	{
+		if (!plproxy_query_add_ident(cur_sql, str))
+			yyerror("invalid argument reference: %s", str);
+	}
+	else
+		plproxy_query_add_const(cur_sql, str);
+}
+
+static void cache_key_finish(void)
+{
+	if (cache_part == 0)
+		yyerror("unterminated CACHE key");
+	if (xfunc->cache_op == CACHE_SET)
+	{
+		if (cache_part != 2)
+			yyerror("CACHE SET requires value");
+		plproxy_query_add_const(cur_sql, ")::text");
+	}
+}
+
 /*
  * report parser error.
  */
@@ -254,6 +453,20 @@ void plproxy_run_parser(ProxyFunction *func, const char *body, int len)
 	if (select_sql && got_target)
 		yyerror("TARGET cannot be used with SELECT");
 
+	/* resolver caching needs resolver function */
+	if (got_cache_cluster && !cluster_sql)
+		yyerror("CACHE CLUSTER requires CLUSTER function");
+	if (got_cache_connect && !connect_sql)
+		yyerror("CACHE CONNECT requires CONNECT function or argument");
+	if (got_cache_run && xfunc->run_type != R_HASH)
+		yyerror("CACHE RUN requires RUN ON function or argument");
+
+	/* keyed cache lifetime */
+	if (got_cache_key && xfunc->cache_op != CACHE_GET && xfunc->cache_op != CACHE_SET)
+		yyerror("CACHE KEY requires CACHE GET or SET");
+	if (!got_cache_key)
+		xfunc->cache_key_ttl = PLPROXY_CACHE_KEY_TTL;
+
 	/* release scanner resources */
 	plproxy_yylex_destroy();
 
@@ -271,6 +484,9 @@ void plproxy_run_parser(ProxyFunction *func, const char *body, int len)
 	if (connect_sql)
 		xfunc->connect_sql = plproxy_query_finish(connect_sql);
 
+	if (cache_sql)
+		xfunc->cache_key_sql = plproxy_query_finish(cache_sql);
+
 	reset_parser_vars();
 }
 
@@ -45,24 +45,33 @@
 
 #include <access/reloptions.h>
 #include <access/tupdesc.h>
+#include <access/hash.h>
+#include <access/xact.h>
 #include <catalog/pg_namespace.h>
 #include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
 #include <commands/trigger.h>
 #include <lib/stringinfo.h>
+#include <libpq/pqformat.h>
 #include <mb/pg_wchar.h>
 #include <miscadmin.h>
 #include <nodes/value.h>
+#include <storage/proc.h>
 #include <utils/acl.h>
 #include <utils/array.h>
 #include <utils/builtins.h>
+#include <utils/datum.h>
 #include <utils/hsearch.h>
 #include "utils/inval.h"
+#include <utils/int8.h>
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/syscache.h>
+#include <utils/timestamp.h>
+#include <utils/uuid.h>
 
 #include "aatree.h"
+#include "strhash.h"
 #include "rowstamp.h"
 
 
@@ -145,17 +154,65 @@
 #define IS_SPLIT_ARG(func, arg)	((func)->split_args && (func)->split_args[arg])
 
 /*
- * Maintenece period in seconds.  Connnections will be freed
- * from stale results, and checked for lifetime.
+ * Maintenece period in seconds.  Connnections will be
+ * checked for lifetime.
  */
 #define PLPROXY_MAINT_PERIOD		(2*60)
 
+/*
+ * Maintenance is done incrementally, checking at most
+ * this many connections per function call.
+ */
+#define PLPROXY_MAINT_BUDGET		64
+
 /*
  * Check connections that are idle more than this many seconds.
  * Set 0 to always check.
  */
 #define PLPROXY_IDLE_CONN_CHECK		2
 
+/*
+ * Max number of asynchronous calls in progress per backend.
+ */
+#define PLPROXY_ASYNC_MAX			64
+
+/*
+ * Max number of remembered CONNECT strings, least recently
+ * used ones are dropped together with their connections.
+ */
+#define PLPROXY_FAKE_CLUSTER_MAX	256
+
+/*
+ * Max number of NULL argument variants of generated
+ * remote query kept per function.
+ */
+#define PLPROXY_NULL_VARIANTS_MAX	16
+
+/*
+ * Partitions get statement_timeout this many milliseconds
+ * over proxy's own limit, so proxy-side timeout and cancel
+ * take effect first.
+ */
+#define PLPROXY_REMOTE_TIMEOUT_GRACE	1000
+
+/*
+ * Limits for proxy-side result cache.
+ */
+#define PLPROXY_CACHE_MAX_ENTRIES	4096
+#define PLPROXY_CACHE_MAX_SIZE		(16*1024*1024)
+
+/* How long CACHE GET/SET values are kept by default, in seconds */
+#define PLPROXY_CACHE_KEY_TTL		60
+
+/* Type of CACHE GET/SET/INVALIDATE statement */
+typedef enum ProxyCacheOp
+{
+	CACHE_NONE = 0,				/* no key statement */
+	CACHE_GET = 1,				/* serve result from key */
+	CACHE_SET = 2,				/* store value under key after call */
+	CACHE_INVALIDATE = 3		/* drop key after call */
+} ProxyCacheOp;
+
 /* Flag indicating where function should be executed */
 typedef enum RunOnType
 {
@@ -183,7 +240,11 @@ typedef struct ProxyConfig
 	int			connect_timeout;		/* How long connect may take (secs) */
 	int			query_timeout;			/* How long query may take (secs) */
 	int			connection_lifetime;	/* How long the connection may live (secs) */
+	int			idle_timeout;			/* How long the connection may be unused (secs) */
 	int			disable_binary;			/* Avoid binary I/O */
+	int			retry_send;				/* Resend on reconnect if send fails */
+	int			max_result_rows;		/* Max rows in results of one call */
+	int64		max_result_bytes;		/* Max memory for results of one call */
 	/* keepalive parameters */
 	int			keepidle;
 	int			keepintvl;
@@ -192,7 +253,7 @@ typedef struct ProxyConfig
 } ProxyConfig;
 
 typedef struct ConnUserInfo {
-	struct AANode node;
+	struct StrHashNode node;
 	Oid user_oid;
 
 	char *username;
@@ -203,7 +264,7 @@ typedef struct ConnUserInfo {
 } ConnUserInfo;
 
 typedef struct ProxyConnectionState {
-	struct AANode node;			/* node head in user->state tree */
+	struct StrHashNode node;	/* node head in user->state hash */
 
 	ConnUserInfo *userinfo;
 
@@ -214,17 +275,31 @@ typedef struct ProxyConnectionState {
 	bool		same_ver;		/* True if dest backend has same X.Y ver */
 	bool		tuning;			/* True if tuning query is running on conn */
 	bool		waitCancel;		/* True if waiting for answer from cancel */
+
+	struct ProxyConnection *owner;	/* Call using the connection, NULL if free */
+	struct ProxyConnectionState *next;	/* Extra connection for same user */
 } ProxyConnectionState;
 
-/* Single database connection */
-typedef struct ProxyConnection
+/* Remote database, shared by partitions with same connect string */
+typedef struct ProxyDatabase
 {
-	struct AANode node;
+	struct StrHashNode node;
 
 	struct ProxyCluster *cluster;
 	const char *connstr;		/* Connection string for libpq */
+	int			index;			/* Position in ProxyExec->conn_map */
 
-	struct AATree userstate_tree; /* user->state tree */
+	struct StrHash userstate_hash; /* user->state hash */
+	ProxyConnectionState *last_state; /* last used state, shortcut for hash lookup */
+} ProxyDatabase;
+
+/* Database connection as used by single call */
+typedef struct ProxyConnection
+{
+	struct ProxyCluster *cluster;
+	struct ProxyExec *exec;		/* Call the connection belongs to */
+	ProxyDatabase *database;
+	const char *connstr;		/* Connection string for libpq */
 
 	/* state */
 	PGresult   *res;			/* last resultset */
@@ -237,60 +312,94 @@ typedef struct ProxyConnection
 	 */
 	int			run_tag;
 
+	/* True if connection was already open before current call */
+	bool		reused;
+
+	/* True if rows are received in single-row mode */
+	bool		single_row;
+
+	/* True if statement_timeout result is expected before query results */
+	bool		timeout_pending;
+
+	/* When query was sent, in milliseconds, for TIMEOUT */
+	int64		query_start_ms;
+
 	/*
 	 * Per-connection parameters. These are a assigned just before the 
 	 * remote call is made.
 	 */
 
-	Datum			   *split_params;					/* Split array parameters */
-	ArrayBuildState	  **bstate;							/* Temporary build state */
-	const char		   *param_values[FUNC_MAX_ARGS];	/* Parameter values */
-	int					param_lengths[FUNC_MAX_ARGS];	/* Parameter lengths (binary io) */
-	int					param_formats[FUNC_MAX_ARGS];	/* Parameter formats (binary io) */
+	int				   *split_rows;						/* Split array rows for this partition */
+	int					split_row_count;				/* Number of rows in split_rows */
+	int					split_row_alloc;				/* Allocated size of split_rows */
+	const char		  **param_values;		/* Parameter values */
+	int				   *param_lengths;		/* Parameter lengths (binary io) */
+	int				   *param_formats;		/* Parameter formats (binary io) */
 } ProxyConnection;
 
 /* Info about one cluster */
 typedef struct ProxyCluster
 {
-	struct AANode node;			/* Node in name => cluster lookup tree */
+	struct StrHashNode node;	/* Node in name => cluster lookup hash */
 
 	const char *name;			/* Cluster name */
 	int			version;		/* Cluster version */
+	uint32		part_generation; /* Incremented when partitions are reloaded */
 	ProxyConfig config;			/* Cluster config */
 
 	int			part_count;		/* Number of partitions - power of 2 */
 	int			part_mask;		/* Mask to use to get part number from hash */
-	ProxyConnection **part_map; /* Pointers to ProxyConnections */
+	ProxyDatabase **part_map;	/* Pointers to ProxyDatabases */
+	int			db_count;		/* Number of distinct databases */
 
-	int active_count;			/* number of active connections */
-	ProxyConnection **active_list; /* active ProxyConnection in current query */
-
-	struct AATree conn_tree;	/* connstr -> ProxyConnection */
+	struct StrHash conn_hash;	/* connstr -> ProxyDatabase */
 
-	struct AATree userinfo_tree; /* username->userinfo tree */
+	struct StrHash userinfo_hash; /* username->userinfo hash */
 	ConnUserInfo *cur_userinfo;	/* userinfo struct for current request */
 
-	int			ret_cur_conn;	/* Result walking: index of current conn */
-	int			ret_cur_pos;	/* Result walking: index of current row */
-	int			ret_total;		/* Result walking: total rows left */
+	int			exec_count;		/* Calls in progress, partitions are not reloaded meanwhile */
+	int			fake_refs;		/* Connect strings using this fake cluster */
 
 	Oid			sqlmed_server_oid;
 
 	bool		fake_cluster;	/* single connect-string cluster */
 	bool		sqlmed_cluster;	/* True if the cluster is defined using SQL/MED */
 	bool		needs_reload;	/* True if the cluster partition list should be reloaded */
-	bool		busy;			/* True if the cluster is already involved in execution */
 
 	/*
 	 * SQL/MED clusters: TIDs of the foreign server and user mapping catalog tuples.
 	 * Used in to perform cluster invalidation in syscache callbacks.
 	 */
 	SysCacheStamp clusterStamp;
-
-	/* notice processing: provide info about currently executing function */
-	struct ProxyFunction	*cur_func;
 } ProxyCluster;
 
+/*
+ * State of one call executing on cluster.
+ *
+ * Kept separate from cluster, so several calls on same cluster
+ * can be in progress at the same time.
+ */
+typedef struct ProxyExec
+{
+	struct ProxyFunction *func;	/* Function being executed */
+	ProxyCluster *cluster;		/* Cluster to run on */
+	ConnUserInfo *userinfo;		/* User for connections */
+	MemoryContext ctx;			/* Per-call allocations */
+
+	ProxyConnection **conn_map;	/* Connections by ProxyDatabase->index */
+	int			active_count;	/* number of active connections */
+	ProxyConnection **active_list; /* active ProxyConnection in current query */
+
+	struct ProxyQuery *query;	/* Remote query for this call */
+
+	int			ret_cur_conn;	/* Result walking: index of current conn */
+	int			ret_total;		/* Result walking: total rows left */
+	int64		result_rows;	/* Rows in arrived results */
+	int64		result_bytes;	/* Memory used by PGresults, outside of ctx */
+
+	struct ProxyExec *next;		/* List of calls in progress */
+} ProxyExec;
+
 /*
  * Type info cache.
  *
@@ -306,6 +415,7 @@ typedef struct ProxyType
 	Oid			io_param;		/* Extra arg for input_func */
 	bool		for_send;		/* True if for outputting */
 	bool		has_send;		/* Has binary output */
+	bool		send_valid;		/* send_func is filled, even if not used for remote */
 	bool		has_recv;		/* Has binary input */
 	bool		by_value;		/* False if Datum is a pointer to data */
 	char		alignment;		/* Type alignment */
@@ -313,6 +423,7 @@ typedef struct ProxyType
 	Oid			elem_type_oid;	/* Array element type oid */
 	struct ProxyType *elem_type_t;	/* Elem type info, filled lazily */
 	short		length;			/* Type length */
+	char		delim;			/* Delimiter in array literals */
 
 	/* I/O functions */
 	union
@@ -345,6 +456,18 @@ typedef struct ProxyComposite
 	bool		use_binary;		/* True if all columns support binary recv */
 	bool		alterable;		/* if it's real table that can change */
 	RowStamp	stamp;
+
+	/*
+	 * Per-row scratch space for result conversion, sized to tupdesc->natts.
+	 * Column values are converted in row_ctx which is reset after
+	 * each tuple is formed.
+	 */
+	char	  **row_values;
+	int		   *row_lengths;
+	int		   *row_fmts;
+	Datum	   *row_datums;
+	bool	   *row_nulls;
+	MemoryContext row_ctx;
 } ProxyComposite;
 
 /* Temp structure for query parsing */
@@ -360,6 +483,8 @@ typedef struct ProxyQuery
 	int			arg_count;		/* Argument count for ->sql */
 	int		   *arg_lookup;		/* Maps local references to function args */
 	void	   *plan;			/* Optional prepared plan for local queries */
+	bool	   *null_args;		/* Variant: args given as NULL literals */
+	struct ProxyQuery *next;	/* Next variant of same query */
 } ProxyQuery;
 
 /*
@@ -371,8 +496,28 @@ typedef struct DatumArray
 	Datum	   *values;
 	bool	   *nulls;
 	int			elem_count;
+
+	/*
+	 * Quoted text form of non-NULL elements, filled lazily
+	 * when the array is split in text mode.
+	 */
+	char	   *elem_text;
+	int		   *elem_text_pos;
+	int		   *elem_text_len;
 } DatumArray;
 
+/*
+ * Materialized result rows, used by result cache.
+ */
+typedef struct ProxyResultRows
+{
+	int			nrows;
+	Datum	   *values;
+	bool	   *nulls;
+	bool		by_value;		/* Datum type info for copying */
+	int16		typlen;
+} ProxyResultRows;
+
 /*
  * Complete info about compiled function.
  *
@@ -409,38 +554,108 @@ typedef struct ProxyFunction
 	const char *connect_str;	/* libpq string for CONNECT function */
 	ProxyQuery *connect_sql;	/* Optional query for CONNECT function */
 	const char *target_name;	/* Optional target function name */
+	int			cache_ttl;		/* CACHE TTL in seconds, 0 if not cached */
+	ProxyCacheOp cache_op;		/* CACHE GET/SET/INVALIDATE */
+	const char *cache_key_name;	/* Key name for cache_op */
+	ProxyQuery *cache_key_sql;	/* Query to calculate key and value */
+	int			cache_key_ttl;	/* CACHE KEY TTL, seconds to keep keyed values */
+	ProxyType  *cache_out_type;	/* Output info for storing CACHE GET results */
+	int			cluster_cache_ttl;	/* CACHE CLUSTER TTL, 0 if not cached */
+	int			connect_cache_ttl;	/* CACHE CONNECT TTL, 0 if not cached */
+	int			run_cache_ttl;	/* CACHE RUN TTL, 0 if not cached */
+	int			timeout_ms;		/* TIMEOUT in milliseconds, 0 if not given */
 
 	/*
 	 * calculated data
 	 */
 
 	ProxyQuery *remote_sql;		/* query to be run repotely */
+	bool		remote_sql_generated;	/* remote_sql is based on signature */
+	ProxyQuery *null_variants;	/* remote_sql with NULL arguments inlined */
+	int			null_variant_count;
 
 	/*
 	 * current execution data
 	 */
 
 	/*
-	 * Cluster to be executed on.  In case of CONNECT,
-	 * function's private fake cluster object.
+	 * Number of calls in progress.  If function is replaced
+	 * meanwhile, it is freed when the last one is released.
+	 */
+	int			use_count;
+	bool		replaced;		/* Removed from function cache */
+	struct ProxyFunction *next_free;	/* Link in list of replaced functions */
+
+	/*
+	 * Call being executed.  Calls may be nested or interleaved,
+	 * so it is set on each entry to execution and result code.
 	 */
-	ProxyCluster *cur_cluster;
+	struct ProxyExec *cur_exec;
+
+	/*
+	 * Resolved cluster for literal CLUSTER name, and userinfo
+	 * for last user.  The userinfo is valid only while
+	 * cached_user_gen matches role invalidation counter.
+	 */
+	ProxyCluster *cached_cluster;
+	ConnUserInfo *cached_userinfo;
+	Oid			cached_user_oid;
+	uint32		cached_user_gen;
 
 	/*
 	 * Maps result field num to libpq column num.
 	 * It is filled for each result.  NULL when scalar result.
 	 */
 	int		   *result_map;
+
+	/*
+	 * Result shape (column count, names and types) that ->result_map
+	 * was last built for.  Lets partitions returning identical layouts
+	 * skip the name matching.  Fingerprint is checked first, then
+	 * the actual names and types.
+	 */
+	uint32		result_map_shape;
+	int			result_map_nfields;	/* Column count */
+	char	   *result_map_names;	/* Column names, NUL-separated */
+	Oid		   *result_map_types;	/* Column type OIDs */
+	bool		result_map_valid;
 } ProxyFunction;
 
+/* cache.c */
+void		plproxy_cache_init(void);
+ProxyResultRows *plproxy_cache_lookup(const char *key, int key_len);
+void		plproxy_cache_store(Oid owner, const char *key, int key_len,
+								int ttl, ProxyResultRows *rows);
+void		plproxy_cache_remove(const char *key, int key_len);
+void		plproxy_cache_purge(Oid owner);
+ProxyResultRows *plproxy_cache_call_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+										   StringInfo *key);
+ProxyResultRows *plproxy_cache_call_fill(ProxyFunction *func, FunctionCallInfo fcinfo,
+										 StringInfo key);
+void		plproxy_cache_call_update(ProxyFunction *func, FunctionCallInfo fcinfo);
+char	   *plproxy_cache_resolved_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+										  ProxyQuery *query, char kind, StringInfo *key);
+void		plproxy_cache_resolved_store(ProxyFunction *func, StringInfo key,
+										 const char *name, int ttl);
+ProxyResultRows *plproxy_cache_hash_lookup(ProxyFunction *func, FunctionCallInfo fcinfo,
+										   StringInfo *key);
+
 /* main.c */
 Datum		plproxy_call_handler(PG_FUNCTION_ARGS);
 Datum		plproxy_validator(PG_FUNCTION_ARGS);
+void		plproxy_startup_init(void);
 void		plproxy_error_with_state(ProxyFunction *func, int sqlstate, const char *fmt, ...)
 	__attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
 void		plproxy_remote_error(ProxyFunction *func, ProxyConnection *conn, const PGresult *res, bool iserr);
 #define plproxy_error(func,...) plproxy_error_with_state((func), ERRCODE_INTERNAL_ERROR, __VA_ARGS__)
 
+/* async.c */
+Datum		plproxy_call_async(PG_FUNCTION_ARGS);
+Datum		plproxy_wait(PG_FUNCTION_ARGS);
+Datum		plproxy_fetch(PG_FUNCTION_ARGS);
+Datum		plproxy_result_bytes(PG_FUNCTION_ARGS);
+Datum		plproxy_last_result_bytes(PG_FUNCTION_ARGS);
+
 /* function.c */
 void		plproxy_function_cache_init(void);
 void	   *plproxy_func_alloc(ProxyFunction *func, int size);
@@ -449,11 +664,15 @@ int			plproxy_get_parameter_index(ProxyFunction *func, const char *ident);
 bool		plproxy_split_add_ident(ProxyFunction *func, const char *ident);
 void		plproxy_split_all_arrays(ProxyFunction *func);
 ProxyFunction *plproxy_compile_and_cache(FunctionCallInfo fcinfo);
+void		plproxy_function_release(ProxyFunction *func);
 ProxyFunction *plproxy_compile(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool validate_only);
 
 /* execute.c */
-void		plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo);
-void		plproxy_clean_results(ProxyCluster *cluster);
+ProxyExec  *plproxy_exec(ProxyFunction *func, ProxyCluster *cluster, FunctionCallInfo fcinfo);
+ProxyExec  *plproxy_exec_launch(ProxyFunction *func, ProxyCluster *cluster, FunctionCallInfo fcinfo);
+void		plproxy_exec_finish(ProxyExec *exec);
+void		plproxy_exec_release(ProxyExec *exec);
+int64		plproxy_exec_last_result_bytes(void);
 void		plproxy_disconnect(ProxyConnectionState *cur);
 
 /* scanner.c */
@@ -473,6 +692,8 @@ ProxyComposite *plproxy_composite_info(ProxyFunction *func, TupleDesc tupdesc);
 ProxyType  *plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send);
 ProxyType  *plproxy_get_elem_type(ProxyFunction *func, ProxyType *type, bool for_send);
 char	   *plproxy_send_type(ProxyType *type, Datum val, bool allow_bin, int *len, int *fmt);
+char	   *plproxy_send_split_array(DatumArray *da, const int *rows, int nrows,
+									 bool allow_bin, int *len, int *fmt);
 Datum		plproxy_recv_type(ProxyType *type, char *str, int len, bool bin);
 HeapTuple	plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *fmts);
 void		plproxy_free_type(ProxyType *type);
@@ -483,11 +704,11 @@ bool		plproxy_composite_valid(ProxyComposite *type);
 void		plproxy_cluster_cache_init(void);
 void		plproxy_syscache_callback_init(void);
 ProxyCluster *plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo);
-void		plproxy_cluster_maint(struct timeval * now);
-void		plproxy_activate_connection(struct ProxyConnection *conn);
+bool		plproxy_cluster_maint(struct timeval * now, int budget);
+ProxyConnection *plproxy_activate_connection(ProxyExec *exec, ProxyDatabase *db);
 
 /* result.c */
-Datum		plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo);
+Datum		plproxy_result(ProxyExec *exec, FunctionCallInfo fcinfo);
 
 /* query.c */
 QueryBuffer *plproxy_query_start(ProxyFunction *func, bool add_types);
@@ -495,6 +716,7 @@ bool		plproxy_query_add_const(QueryBuffer *q, const char *data);
 bool		plproxy_query_add_ident(QueryBuffer *q, const char *ident);
 ProxyQuery *plproxy_query_finish(QueryBuffer *q);
 ProxyQuery *plproxy_standard_query(ProxyFunction *func, bool add_types);
+ProxyQuery *plproxy_remote_query(ProxyFunction *func, FunctionCallInfo fcinfo);
 void		plproxy_query_prepare(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *q, bool split_support);
 void		plproxy_query_exec(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *q,
 							   DatumArray **array_params, int array_row);
@@ -137,6 +137,8 @@ plproxy_query_finish(QueryBuffer *q)
 	len = q->arg_count * sizeof(int);
 	pq->arg_lookup = palloc(len);
 	pq->plan = NULL;
+	pq->null_args = NULL;
+	pq->next = NULL;
 
 	memcpy(pq->arg_lookup, q->arg_lookup, len);
 
@@ -157,9 +159,12 @@ plproxy_query_finish(QueryBuffer *q)
 
 /*
  * Generate a function call based on own signature.
+ *
+ * Arguments marked in null_args are given as NULL literals,
+ * instead of parameter references.
  */
-ProxyQuery *
-plproxy_standard_query(ProxyFunction *func, bool add_types)
+static ProxyQuery *
+make_standard_query(ProxyFunction *func, bool add_types, const bool *null_args)
 {
 	StringInfoData sql;
 	ProxyQuery *pq;
@@ -170,8 +175,10 @@ plproxy_standard_query(ProxyFunction *func, bool add_types)
 	pq = plproxy_func_alloc(func, sizeof(*pq));
 	pq->sql = NULL;
 	pq->plan = NULL;
-	pq->arg_count = func->arg_count;
-	len = pq->arg_count * sizeof(int);
+	pq->null_args = NULL;
+	pq->next = NULL;
+	pq->arg_count = 0;
+	len = func->arg_count * sizeof(int);
 	pq->arg_lookup = plproxy_func_alloc(func, len);
 
 	initStringInfo(&sql);
@@ -205,8 +212,14 @@ plproxy_standard_query(ProxyFunction *func, bool add_types)
 		if (i > 0)
 			appendStringInfoChar(&sql, ',');
 
-		add_ref(&sql, i, func, i, add_types);
-		pq->arg_lookup[i] = i;
+		if (null_args && null_args[i])
+		{
+			appendStringInfo(&sql, "NULL::%s", func->arg_types[i]->name);
+			continue;
+		}
+
+		add_ref(&sql, pq->arg_count, func, i, add_types);
+		pq->arg_lookup[pq->arg_count++] = i;
 	}
 	appendStringInfoChar(&sql, ')');
 
@@ -238,6 +251,63 @@ plproxy_standard_query(ProxyFunction *func, bool add_types)
 	return pq;
 }
 
+/*
+ * Generate a function call based on own signature.
+ */
+ProxyQuery *
+plproxy_standard_query(ProxyFunction *func, bool add_types)
+{
+	return make_standard_query(func, add_types, NULL);
+}
+
+/*
+ * Pick remote query for a call.
+ *
+ * For generated query, NULL arguments are put into query as
+ * literals, so they are not sent and partitions plan with
+ * known NULLs.  Variants are kept per NULL argument combination.
+ */
+ProxyQuery *
+plproxy_remote_query(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	bool		null_args[FUNC_MAX_ARGS];
+	bool		have_null = false;
+	ProxyQuery *pq;
+	int			i;
+
+	if (!func->remote_sql_generated)
+		return func->remote_sql;
+
+	for (i = 0; i < func->arg_count; i++)
+	{
+		null_args[i] = PG_ARGISNULL(i);
+		if (null_args[i])
+			have_null = true;
+	}
+	if (!have_null)
+		return func->remote_sql;
+
+	for (pq = func->null_variants; pq; pq = pq->next)
+	{
+		if (memcmp(pq->null_args, null_args, func->arg_count * sizeof(bool)) == 0)
+			return pq;
+	}
+
+	/* too many combinations, send NULLs as parameters */
+	if (func->null_variant_count >= PLPROXY_NULL_VARIANTS_MAX)
+		return func->remote_sql;
+
+	pq = make_standard_query(func, true, null_args);
+	pq->null_args = plproxy_func_alloc(func, func->arg_count * sizeof(bool));
+	memcpy(pq->null_args, null_args, func->arg_count * sizeof(bool));
+
+	pq->next = func->null_variants;
+	func->null_variants = pq;
+	func->null_variant_count++;
+
+	return pq;
+}
+
 /*
  * Prepare ProxyQuery for local execution
  */
@@ -38,7 +38,87 @@ name_matches(ProxyFunction *func, const char *aname, PGresult *res, int col)
 	return false;
 }
 
-/* fill func->result_map */
+/* Fingerprint result column names and types */
+static uint32
+result_shape(PGresult *res)
+{
+	int			i,
+				nfields = PQnfields(res);
+	uint32		h = nfields;
+	const char *fname;
+
+	for (i = 0; i < nfields; i++)
+	{
+		fname = PQfname(res, i);
+		h = (h << 5) | (h >> 27);
+		if (fname != NULL)
+			h ^= DatumGetUInt32(hash_any((const unsigned char *) fname,
+										 strlen(fname)));
+		h = (h << 5) | (h >> 27);
+		h ^= PQftype(res, i);
+	}
+	return h;
+}
+
+/* Check if result has exactly the shape result_map was built for */
+static bool
+same_shape(ProxyFunction *func, PGresult *res)
+{
+	int			i,
+				nfields = PQnfields(res);
+	const char *name = func->result_map_names;
+	const char *fname;
+
+	if (nfields != func->result_map_nfields)
+		return false;
+
+	for (i = 0; i < nfields; i++)
+	{
+		fname = PQfname(res, i);
+		if (fname == NULL || strcmp(name, fname) != 0)
+			return false;
+		if (PQftype(res, i) != func->result_map_types[i])
+			return false;
+		name += strlen(name) + 1;
+	}
+	return true;
+}
+
+/* Remember shape of result, for same_shape() */
+static void
+save_shape(ProxyFunction *func, PGresult *res, uint32 shape)
+{
+	int			i,
+				len = 0,
+				nfields = PQnfields(res);
+	char	   *p;
+
+	if (func->result_map_names)
+		pfree(func->result_map_names);
+	if (func->result_map_types)
+		pfree(func->result_map_types);
+
+	for (i = 0; i < nfields; i++)
+		len += strlen(PQfname(res, i)) + 1;
+
+	func->result_map_names = p = plproxy_func_alloc(func, len);
+	func->result_map_types = plproxy_func_alloc(func, nfields * sizeof(Oid));
+	for (i = 0; i < nfields; i++)
+	{
+		strcpy(p, PQfname(res, i));
+		p += strlen(p) + 1;
+		func->result_map_types[i] = PQftype(res, i);
+	}
+	func->result_map_shape = shape;
+	func->result_map_nfields = nfields;
+}
+
+/*
+ * Fill func->result_map.
+ *
+ * The map is kept as long as following results have same shape,
+ * so usually it is calculated only once per function.
+ */
 static void
 map_results(ProxyFunction *func, PGresult *res)
 {
@@ -49,6 +129,7 @@ map_results(ProxyFunction *func, PGresult *res)
 				nfields = PQnfields(res);
 	Form_pg_attribute a;
 	const char *aname;
+	uint32		shape;
 
 	if (func->ret_scalar)
 	{
@@ -64,6 +145,12 @@ map_results(ProxyFunction *func, PGresult *res)
 	if (nfields > func->ret_composite->nfields)
 		plproxy_error(func, "Got too many fields from remote end");
 
+	shape = result_shape(res);
+	if (func->result_map_valid && func->result_map_shape == shape
+		&& same_shape(func, res))
+		return;
+	func->result_map_valid = false;
+
 	for (i = -1, xi = 0; xi < natts; xi++)
 	{
 		/* ->name_list has quoted names, take unquoted from ->tupdesc */
@@ -102,18 +189,21 @@ map_results(ProxyFunction *func, PGresult *res)
 			plproxy_error(func,
 						  "Field %s does not exists in result", aname);
 	}
+
+	save_shape(func, res, shape);
+	func->result_map_valid = true;
 }
 
 /* Return connection where are unreturned rows */
 static ProxyConnection *
-walk_results(ProxyFunction *func, ProxyCluster *cluster)
+walk_results(ProxyFunction *func, ProxyExec *exec)
 {
 	ProxyConnection *conn;
 
-	for (; cluster->ret_cur_conn < cluster->active_count;
-		 cluster->ret_cur_conn++)
+	for (; exec->ret_cur_conn < exec->active_count;
+		 exec->ret_cur_conn++)
 	{
-		conn = cluster->active_list[cluster->ret_cur_conn];
+		conn = exec->active_list[exec->ret_cur_conn];
 		if (conn->res == NULL)
 			continue;
 		if (conn->pos == PQntuples(conn->res))
@@ -136,15 +226,11 @@ return_composite(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fc
 {
 	int			i,
 				col;
-	char	  **values;
-	int		   *fmts;
-	int		   *lengths;
 	HeapTuple	tup;
 	ProxyComposite *meta = func->ret_composite;
-
-	values = palloc(meta->tupdesc->natts * sizeof(char *));
-	fmts = palloc(meta->tupdesc->natts * sizeof(int));
-	lengths = palloc(meta->tupdesc->natts * sizeof(int));
+	char	  **values = meta->row_values;
+	int		   *fmts = meta->row_fmts;
+	int		   *lengths = meta->row_lengths;
 
 	for (i = 0; i < meta->tupdesc->natts; i++)
 	{
@@ -164,10 +250,6 @@ return_composite(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fc
 	}
 	tup = plproxy_recv_composite(meta, values, lengths, fmts);
 
-	pfree(lengths);
-	pfree(fmts);
-	pfree(values);
-
 	return HeapTupleGetDatum(tup);
 }
 
@@ -203,20 +285,21 @@ return_scalar(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinf
 
 /* Return next result Datum */
 Datum
-plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo)
+plproxy_result(ProxyExec *exec, FunctionCallInfo fcinfo)
 {
 	Datum		dat;
-	ProxyCluster *cluster = func->cur_cluster;
+	ProxyFunction *func = exec->func;
 	ProxyConnection *conn;
 
-	conn = walk_results(func, cluster);
+	func->cur_exec = exec;
+	conn = walk_results(func, exec);
 
 	if (func->ret_composite)
 		dat = return_composite(func, conn, fcinfo);
 	else
 		dat = return_scalar(func, conn, fcinfo);
 
-	cluster->ret_total--;
+	exec->ret_total--;
 	conn->pos++;
 
 	return dat;
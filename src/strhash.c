@@ -0,0 +1,189 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * String-keyed hash index for cluster, connection and user lookups.
+ *
+ * Open addressing with linear probing.  The table is kept at most
+ * half full, so probe sequences stay short.  Removal uses backward
+ * shifting, so there are no tombstones.
+ */
+
+#include "plproxy.h"
+
+#define STRHASH_MIN_SIZE	8
+
+typedef struct StrHash Hash;
+typedef struct StrHashNode HashNode;
+
+static uint32
+key_hash(const char *key)
+{
+	return DatumGetUInt32(hash_any((const unsigned char *) key, strlen(key)));
+}
+
+/* find slot for key, either matching node or empty */
+static uint32
+find_slot(Hash *h, const char *key, uint32 hash)
+{
+	uint32		i = hash & h->mask;
+	HashNode   *node;
+
+	while ((node = h->table[i]) != NULL)
+	{
+		if (node->hash == hash && strcmp(node->key, key) == 0)
+			break;
+		i = (i + 1) & h->mask;
+	}
+	return i;
+}
+
+static void
+resize(Hash *h, uint32 size)
+{
+	HashNode  **old = h->table;
+	uint32		old_size = old ? h->mask + 1 : 0;
+	uint32		i, j;
+
+	h->table = MemoryContextAllocZero(h->ctx, size * sizeof(HashNode *));
+	h->mask = size - 1;
+
+	for (i = 0; i < old_size; i++)
+	{
+		if (!old[i])
+			continue;
+		j = old[i]->hash & h->mask;
+		while (h->table[j])
+			j = (j + 1) & h->mask;
+		h->table[j] = old[i];
+	}
+
+	if (old)
+		pfree(old);
+}
+
+/* prepare hash, table is allocated on first insert */
+void
+strhash_init(Hash *h, MemoryContext ctx, strhash_walker_f release_cb)
+{
+	h->table = NULL;
+	h->mask = 0;
+	h->count = 0;
+	h->ctx = ctx;
+	h->release_cb = release_cb;
+}
+
+HashNode *
+strhash_search(Hash *h, const char *key)
+{
+	if (!h->count)
+		return NULL;
+	return h->table[find_slot(h, key, key_hash(key))];
+}
+
+void
+strhash_insert(Hash *h, const char *key, HashNode *node)
+{
+	uint32		size = h->table ? h->mask + 1 : 0;
+
+	if ((h->count + 1) * 2 > size)
+		resize(h, size ? size * 2 : STRHASH_MIN_SIZE);
+
+	node->key = key;
+	node->hash = key_hash(key);
+	h->table[find_slot(h, key, node->hash)] = node;
+	h->count++;
+}
+
+void
+strhash_remove(Hash *h, const char *key)
+{
+	uint32		i, j, k;
+	HashNode   *node;
+
+	if (!h->count)
+		return;
+
+	i = find_slot(h, key, key_hash(key));
+	node = h->table[i];
+	if (!node)
+		return;
+
+	/* move following nodes back, if their home slot allows it */
+	h->table[i] = NULL;
+	for (j = (i + 1) & h->mask; h->table[j]; j = (j + 1) & h->mask)
+	{
+		k = h->table[j]->hash & h->mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+		{
+			h->table[i] = h->table[j];
+			h->table[j] = NULL;
+			i = j;
+		}
+	}
+	h->count--;
+
+	if (h->release_cb)
+		h->release_cb(node, h);
+}
+
+/*
+ * Resumable iteration.  Positions stay usable when hash changes
+ * between calls, but then nodes may be skipped or seen twice.
+ */
+HashNode *
+strhash_next(Hash *h, uint32 *pos)
+{
+	uint32		i;
+
+	if (!h->table)
+		return NULL;
+	for (i = *pos; i <= h->mask; i++)
+	{
+		if (h->table[i])
+		{
+			*pos = i;
+			return h->table[i];
+		}
+	}
+	return NULL;
+}
+
+void
+strhash_walk(Hash *h, strhash_walker_f walker, void *arg)
+{
+	uint32		i;
+
+	if (!h->table)
+		return;
+	for (i = 0; i <= h->mask; i++)
+	{
+		if (h->table[i])
+			walker(h->table[i], arg);
+	}
+}
+
+void
+strhash_destroy(Hash *h)
+{
+	if (h->release_cb)
+		strhash_walk(h, h->release_cb, h);
+	if (h->table)
+		pfree(h->table);
+	h->table = NULL;
+	h->mask = 0;
+	h->count = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file
+ *
+ * String-keyed hash index with embeddable nodes.
+ *
+ * Open addressing with linear probing, table size is power of 2.
+ * Full hash value is kept in node, so string compare is done
+ * only on hash match.
+ */
+
+#ifndef _PLPROXY_STRHASH_H_
+#define _PLPROXY_STRHASH_H_
+
+struct StrHash;
+struct StrHashNode;
+
+/** Callback for walking the hash */
+typedef void (*strhash_walker_f)(struct StrHashNode *n, void *arg);
+
+/**
+ * Hash header.
+ */
+struct StrHash {
+	struct StrHashNode **table;	/**< slots, NULL if empty */
+	uint32 mask;			/**< table size - 1 */
+	uint32 count;			/**< number of nodes */
+	MemoryContext ctx;		/**< where table is allocated */
+	strhash_walker_f release_cb;
+};
+
+/**
+ * Hash node.  Embeddable, parent structure should be taken
+ * with container_of().  Key must stay valid as long as node
+ * is in hash.
+ */
+struct StrHashNode {
+	const char *key;
+	uint32 hash;
+};
+
+/** Initialize structure */
+void strhash_init(struct StrHash *h, MemoryContext ctx, strhash_walker_f release_cb);
+
+/** Search for node */
+struct StrHashNode *strhash_search(struct StrHash *h, const char *key);
+
+/** Insert new node, key must be stable copy owned by node */
+void strhash_insert(struct StrHash *h, const char *key, struct StrHashNode *node);
+
+/** Remove node, calls release_cb */
+void strhash_remove(struct StrHash *h, const char *key);
+
+/** Find first node at slot *pos or later, update *pos to its slot */
+struct StrHashNode *strhash_next(struct StrHash *h, uint32 *pos);
+
+/** Walk over all nodes, hash must not be changed meanwhile */
+void strhash_walk(struct StrHash *h, strhash_walker_f walker, void *arg);
+
+/** Release all nodes and free table */
+void strhash_destroy(struct StrHash *h);
+
+#endif
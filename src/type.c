@@ -23,6 +23,9 @@
 
 #include "plproxy.h"
 
+#include <float.h>
+#include <math.h>
+
 /*
  * Checks if we can safely use binary.
  */
@@ -123,6 +126,17 @@ plproxy_composite_info(ProxyFunction *func, TupleDesc tupdesc)
 	ret->tupdesc = BlessTupleDesc(tupdesc);
 	ret->use_binary = 1;
 
+	ret->row_values = palloc(sizeof(char *) * natts);
+	ret->row_lengths = palloc(sizeof(int) * natts);
+	ret->row_fmts = palloc(sizeof(int) * natts);
+	ret->row_datums = palloc(sizeof(Datum) * natts);
+	ret->row_nulls = palloc(sizeof(bool) * natts);
+	ret->row_ctx = AllocSetContextCreate(func->ctx,
+										 "PL/Proxy row context",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+
 	ret->alterable = 0;
 	if (oid != RECORDOID)
 	{
@@ -187,6 +201,12 @@ plproxy_free_composite(ProxyComposite *rec)
 	}
 	pfree(rec->type_list);
 	pfree(rec->name_list);
+	pfree(rec->row_values);
+	pfree(rec->row_lengths);
+	pfree(rec->row_fmts);
+	pfree(rec->row_datums);
+	pfree(rec->row_nulls);
+	MemoryContextDelete(rec->row_ctx);
 	FreeTupleDesc(rec->tupdesc);
 	pfree(rec);
 }
@@ -212,19 +232,22 @@ plproxy_free_type(ProxyType *type)
  * Build result tuple from binary or CString values.
  *
  * Based on BuildTupleFromCStrings.
+ *
+ * Column values are converted in meta->row_ctx, the tuple itself
+ * is allocated in CurrentMemoryContext.
  */
 HeapTuple
 plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *fmts)
 {
 	TupleDesc	tupdesc = meta->tupdesc;
 	int			natts = tupdesc->natts;
-	Datum	   *dvalues;
-	bool	   *nulls;
+	Datum	   *dvalues = meta->row_datums;
+	bool	   *nulls = meta->row_nulls;
 	int			i;
 	HeapTuple	tuple;
+	MemoryContext old_ctx;
 
-	dvalues = (Datum *) palloc(natts * sizeof(Datum));
-	nulls = (bool *) palloc(natts * sizeof(bool));
+	old_ctx = MemoryContextSwitchTo(meta->row_ctx);
 
 	/* Call the recv function for each attribute */
 	for (i = 0; i < natts; i++)
@@ -241,22 +264,13 @@ plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *f
 		nulls[i] = (values[i] == NULL);
 	}
 
+	MemoryContextSwitchTo(old_ctx);
+
 	/* Form a tuple */
 	tuple = heap_form_tuple(tupdesc, dvalues, nulls);
 
-	/*
-	 * Release locally palloc'd space.
-	 */
-	for (i = 0; i < natts; i++)
-	{
-		if (nulls[i])
-			continue;
-		if (meta->type_list[i]->by_value)
-			continue;
-		pfree(DatumGetPointer(dvalues[i]));
-	}
-	pfree(dvalues);
-	pfree(nulls);
+	/* Release converted values in one go */
+	MemoryContextReset(meta->row_ctx);
 
 	return tuple;
 }
@@ -331,15 +345,17 @@ plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send)
 	type->elem_type_t = NULL;
 	type->alignment = s_type->typalign;
 	type->length = s_type->typlen;
+	type->delim = s_type->typdelim;
 
 	/* decide what function is needed */
 	if (for_send)
 	{
 		fmgr_info_cxt(s_type->typoutput, &type->io.out.output_func, func->ctx);
-		if (OidIsValid(s_type->typsend) && usable_binary(oid))
+		if (OidIsValid(s_type->typsend))
 		{
 			fmgr_info_cxt(s_type->typsend, &type->io.out.send_func, func->ctx);
-			type->has_send = 1;
+			type->send_valid = 1;
+			type->has_send = usable_binary(oid);
 		}
 	}
 	else
@@ -365,6 +381,215 @@ ProxyType *plproxy_get_elem_type(ProxyFunction *func, ProxyType *type, bool for_
 	return type->elem_type_t;
 }
 
+/*
+ * Text I/O fast paths for common builtin types.
+ *
+ * They give same results as the types' own I/O functions, but skip
+ * fmgr dispatch and intermediate copies.  Anything unusual is left
+ * to the real functions, which also take care of error reporting.
+ */
+
+static const char hextbl[] = "0123456789abcdef";
+
+static int
+hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parse only canonical form: xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx */
+static bool
+parse_uuid(const char *val, int len, pg_uuid_t *uuid)
+{
+	int			i,
+				hi,
+				lo;
+
+	if (len != 36)
+		return false;
+	for (i = 0; i < UUID_LEN; i++)
+	{
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+		{
+			if (*val++ != '-')
+				return false;
+		}
+		hi = hexval(val[0]);
+		lo = hexval(val[1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		uuid->data[i] = (hi << 4) | lo;
+		val += 2;
+	}
+	return true;
+}
+
+static char *
+format_uuid(const pg_uuid_t *uuid)
+{
+	char	   *buf = palloc(2 * UUID_LEN + 5);
+	char	   *p = buf;
+	int			i;
+
+	for (i = 0; i < UUID_LEN; i++)
+	{
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*p++ = '-';
+		*p++ = hextbl[uuid->data[i] >> 4];
+		*p++ = hextbl[uuid->data[i] & 0x0F];
+	}
+	*p = '\0';
+	return buf;
+}
+
+/*
+ * Plain decimal numbers only, special values and
+ * whitespace go through float4in/float8in.
+ */
+static bool
+parse_float(const char *val, double *res)
+{
+	const char *p = val;
+	char	   *end;
+
+	if (*p == '-')
+		p++;
+	if (*p < '0' || *p > '9')
+		return false;
+
+	errno = 0;
+	*res = strtod(val, &end);
+	if (*end != '\0' || errno != 0 || isinf(*res) || isnan(*res))
+		return false;
+	return true;
+}
+
+#if PG_VERSION_NUM < 120000
+/* Same as float4out/float8out */
+static char *
+format_float(double num, int digits)
+{
+	char	   *buf;
+	int			ndig;
+
+	if (isnan(num))
+		return pstrdup("NaN");
+	if (isinf(num))
+		return pstrdup(num > 0 ? "Infinity" : "-Infinity");
+
+	ndig = digits + extra_float_digits;
+	if (ndig < 1)
+		ndig = 1;
+
+	buf = palloc(128 + 1);
+	snprintf(buf, 128 + 1, "%.*g", ndig, num);
+	return buf;
+}
+#endif
+
+/* Returns NULL if no fast path for type */
+static char *
+send_fast(ProxyType *type, Datum val)
+{
+	char	   *buf;
+
+	switch (type->type_oid)
+	{
+		case INT2OID:
+			buf = palloc(7);
+			pg_itoa(DatumGetInt16(val), buf);
+			return buf;
+		case INT4OID:
+			buf = palloc(12);
+			pg_ltoa(DatumGetInt32(val), buf);
+			return buf;
+		case INT8OID:
+			buf = palloc(32);
+			snprintf(buf, 32, INT64_FORMAT, DatumGetInt64(val));
+			return buf;
+		case BOOLOID:
+			return DatumGetBool(val) ? "t" : "f";
+#if PG_VERSION_NUM < 120000
+		case FLOAT4OID:
+			return format_float(DatumGetFloat4(val), FLT_DIG);
+		case FLOAT8OID:
+			return format_float(DatumGetFloat8(val), DBL_DIG);
+#endif
+		case TEXTOID:
+		case VARCHAROID:
+			return TextDatumGetCString(val);
+		case UUIDOID:
+			return format_uuid(DatumGetUUIDP(val));
+		default:
+			return NULL;
+	}
+}
+
+/* Returns false if no fast path for type or value */
+static bool
+recv_fast(ProxyType *type, char *val, int len, Datum *res)
+{
+	int64		i8;
+	double		f8;
+	float4		f4;
+	pg_uuid_t  *uuid;
+
+	switch (type->type_oid)
+	{
+		case INT2OID:
+			*res = Int16GetDatum((int16) pg_atoi(val, sizeof(int16), '\0'));
+			return true;
+		case INT4OID:
+			*res = Int32GetDatum(pg_atoi(val, sizeof(int32), '\0'));
+			return true;
+		case INT8OID:
+			if (!scanint8(val, true, &i8))
+				return false;
+			*res = Int64GetDatum(i8);
+			return true;
+		case BOOLOID:
+			if (len != 1 || (val[0] != 't' && val[0] != 'f'))
+				return false;
+			*res = BoolGetDatum(val[0] == 't');
+			return true;
+		case FLOAT4OID:
+			if (!parse_float(val, &f8))
+				return false;
+			/* overflow and underflow are errors in float4in */
+			f4 = (float4) f8;
+			if (isinf(f4) || (f4 == 0 && f8 != 0))
+				return false;
+			*res = Float4GetDatum(f4);
+			return true;
+		case FLOAT8OID:
+			if (!parse_float(val, &f8))
+				return false;
+			*res = Float8GetDatum(f8);
+			return true;
+		case TEXTOID:
+		case VARCHAROID:
+			*res = PointerGetDatum(cstring_to_text_with_len(val, len));
+			return true;
+		case UUIDOID:
+			uuid = palloc(sizeof(*uuid));
+			if (!parse_uuid(val, len, uuid))
+			{
+				pfree(uuid);
+				return false;
+			}
+			*res = UUIDPGetDatum(uuid);
+			return true;
+		default:
+			return false;
+	}
+}
+
 /* Convert a Datum to parameter for libpq */
 char *
 plproxy_send_type(ProxyType *type, Datum val, bool allow_bin, int *len, int *fmt)
@@ -383,13 +608,239 @@ plproxy_send_type(ProxyType *type, Datum val, bool allow_bin, int *len, int *fmt
 	}
 	else
 	{
-		res = OutputFunctionCall(&type->io.out.output_func, val);
+		res = send_fast(type, val);
+		if (res == NULL)
+			res = OutputFunctionCall(&type->io.out.output_func, val);
 		*len = 0;
 		*fmt = 0;
 	}
 	return res;
 }
 
+/*
+ * Element types that can be shipped in split arrays in binary.
+ *
+ * Their binary format is same on all server versions and does
+ * not depend on server settings, unlike most other types.
+ */
+static bool
+split_binary_elem(Oid oid)
+{
+	switch (oid)
+	{
+		case BOOLOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Same as array_send() on 1-dimensional array of given rows */
+static char *
+send_binary_array(DatumArray *da, const int *rows, int nrows, int *len)
+{
+	StringInfoData buf;
+	bool		has_nulls = false;
+	Datum		val;
+	int			i;
+
+	for (i = 0; i < nrows; i++)
+	{
+		if (da->nulls[rows[i]])
+			has_nulls = true;
+	}
+
+	initStringInfo(&buf);
+	pq_sendint(&buf, nrows > 0 ? 1 : 0, 4);
+	pq_sendint(&buf, has_nulls ? 1 : 0, 4);
+	pq_sendint(&buf, da->type->type_oid, sizeof(Oid));
+	if (nrows > 0)
+	{
+		pq_sendint(&buf, nrows, 4);
+		pq_sendint(&buf, 1, 4);
+	}
+
+	for (i = 0; i < nrows; i++)
+	{
+		if (da->nulls[rows[i]])
+		{
+			pq_sendint(&buf, -1, 4);
+			continue;
+		}
+
+		val = da->values[rows[i]];
+		switch (da->type->type_oid)
+		{
+			case BOOLOID:
+				pq_sendint(&buf, 1, 4);
+				pq_sendbyte(&buf, DatumGetBool(val) ? 1 : 0);
+				break;
+			case INT2OID:
+				pq_sendint(&buf, 2, 4);
+				pq_sendint(&buf, DatumGetInt16(val), 2);
+				break;
+			case INT4OID:
+				pq_sendint(&buf, 4, 4);
+				pq_sendint(&buf, DatumGetInt32(val), 4);
+				break;
+			case OIDOID:
+				pq_sendint(&buf, 4, 4);
+				pq_sendint(&buf, DatumGetObjectId(val), 4);
+				break;
+			case INT8OID:
+				pq_sendint(&buf, 8, 4);
+				pq_sendint64(&buf, DatumGetInt64(val));
+				break;
+			case FLOAT4OID:
+				pq_sendint(&buf, 4, 4);
+				pq_sendfloat4(&buf, DatumGetFloat4(val));
+				break;
+			case FLOAT8OID:
+				pq_sendint(&buf, 8, 4);
+				pq_sendfloat8(&buf, DatumGetFloat8(val));
+				break;
+			default:
+				elog(ERROR, "PL/Proxy: no binary output for type %u",
+					 da->type->type_oid);
+		}
+	}
+
+	*len = buf.len;
+	return buf.data;
+}
+
+/*
+ * Output each non-NULL element once, quoted as in array literal.
+ *
+ * Quoting is always valid for array_in(), so there is no need
+ * to check whether the element actually needs it.
+ */
+static void
+make_elem_text(DatumArray *da)
+{
+	StringInfoData buf;
+	MemoryContext tmp_ctx,
+				old_ctx;
+	char	   *val,
+			   *p;
+	int			i,
+				len,
+				fmt;
+
+	da->elem_text_pos = palloc(da->elem_count * sizeof(int));
+	da->elem_text_len = palloc(da->elem_count * sizeof(int));
+	initStringInfo(&buf);
+
+	tmp_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									"PL/Proxy split element context",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+
+	for (i = 0; i < da->elem_count; i++)
+	{
+		if (da->nulls[i])
+		{
+			da->elem_text_pos[i] = -1;
+			da->elem_text_len[i] = 0;
+			continue;
+		}
+
+		old_ctx = MemoryContextSwitchTo(tmp_ctx);
+		val = plproxy_send_type(da->type, da->values[i], false, &len, &fmt);
+		MemoryContextSwitchTo(old_ctx);
+
+		da->elem_text_pos[i] = buf.len;
+		appendStringInfoChar(&buf, '"');
+		for (p = val; *p; p++)
+		{
+			if (*p == '"' || *p == '\\')
+				appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, *p);
+		}
+		appendStringInfoChar(&buf, '"');
+		da->elem_text_len[i] = buf.len - da->elem_text_pos[i];
+
+		MemoryContextReset(tmp_ctx);
+	}
+
+	MemoryContextDelete(tmp_ctx);
+	da->elem_text = buf.data;
+}
+
+/* Assemble array literal from pre-formatted elements */
+static char *
+send_text_array(DatumArray *da, const int *rows, int nrows)
+{
+	char	   *res,
+			   *p;
+	int			i,
+				row,
+				size = 2 + 1;
+
+	if (!da->elem_text)
+		make_elem_text(da);
+
+	for (i = 0; i < nrows; i++)
+	{
+		row = rows[i];
+		size += (da->nulls[row] ? 4 : da->elem_text_len[row]) + 1;
+	}
+
+	p = res = palloc(size);
+	*p++ = '{';
+	for (i = 0; i < nrows; i++)
+	{
+		row = rows[i];
+		if (i > 0)
+			*p++ = da->type->delim;
+		if (da->nulls[row])
+		{
+			memcpy(p, "NULL", 4);
+			p += 4;
+		}
+		else
+		{
+			memcpy(p, da->elem_text + da->elem_text_pos[row],
+				   da->elem_text_len[row]);
+			p += da->elem_text_len[row];
+		}
+	}
+	*p++ = '}';
+	*p = '\0';
+
+	return res;
+}
+
+/*
+ * Convert a subset of split array elements to parameter for libpq.
+ *
+ * Arrays of simple fixed-width types are sent in binary,
+ * that avoids formatting and parsing large text literals.
+ * Otherwise elements are formatted once per call and
+ * the per-partition literals are assembled from them.
+ */
+char *
+plproxy_send_split_array(DatumArray *da, const int *rows, int nrows,
+						 bool allow_bin, int *len, int *fmt)
+{
+	if (allow_bin && split_binary_elem(da->type->type_oid))
+	{
+		*fmt = 1;
+		return send_binary_array(da, rows, nrows, len);
+	}
+
+	*len = 0;
+	*fmt = 0;
+	return send_text_array(da, rows, nrows);
+}
+
 /*
  * Point StringInfo to fixed buffer.
  *
@@ -427,7 +878,7 @@ plproxy_recv_type(ProxyType *type, char *val, int len, bool bin)
 		res = ReceiveFunctionCall(&type->io.in.recv_func,
 								  &buf, type->io_param, -1);
 	}
-	else
+	else if (!recv_fast(type, val, len, &res))
 	{
 		res = InputFunctionCall(&type->io.in.input_func,
 								val, type->io_param, -1);
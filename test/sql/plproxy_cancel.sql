@@ -21,3 +21,36 @@ select * from rsleep(10);
 -- test if works later
 select * from rsleep(0);
 
+-- test function TIMEOUT
+reset statement_timeout;
+create function rsleep_timeout(val int4, out res int4) returns setof int4 as $$
+    cluster 'testcluster';
+    run on all;
+    target rsleep;
+    timeout 200 ms;
+$$ language plproxy;
+select * from rsleep_timeout(10);
+select * from rsleep_timeout(0);
+
+-- test statement_timeout passed to partitions
+create function remote_timeout_setting() returns int4 as $$
+    connect 'dbname=test_part';
+    timeout 2 s;
+    select setting::int4 from pg_catalog.pg_settings where name = 'statement_timeout';
+$$ language plproxy;
+create function remote_timeout_setting2() returns int4 as $$
+    connect 'dbname=test_part';
+    select setting::int4 from pg_catalog.pg_settings where name = 'statement_timeout';
+$$ language plproxy;
+create function remote_timeout_after_sleep(val float8) returns int4 as $$
+begin
+    perform pg_sleep(val);
+    return remote_timeout_setting2();
+end; $$ language plpgsql;
+select * from remote_timeout_setting();
+set statement_timeout = '5s';
+select remote_timeout_setting2() between 5000 and 6000;
+-- only time left of local statement is passed on
+select remote_timeout_after_sleep(2) between 3000 and 4000;
+reset statement_timeout;
+select * from remote_timeout_setting2();
@@ -136,3 +136,60 @@ begin
 end;
 $$ language plpgsql;
 select * from test_multi_results();
+
+-- result cache errors
+create function test_cache_err1(dat text)
+returns text as $$
+    cluster 'testcluster';
+    cache ttl 0;
+$$ language plproxy;
+
+create function test_cache_err2(dat text)
+returns text as $$
+    cluster 'testcluster';
+    cache foo 10;
+$$ language plproxy;
+
+create function test_cache_err3(dat text)
+returns setof record as $$
+    cluster 'testcluster';
+    run on all;
+    cache ttl 10;
+$$ language plproxy;
+
+create function test_cache_err4(dat text)
+returns setof text as $$
+    cluster 'testcluster';
+    cache get object(dat);
+$$ language plproxy;
+
+create function test_cache_err5(dat text)
+returns text as $$
+    cluster 'testcluster';
+    cache set object(dat);
+$$ language plproxy;
+
+create function test_cache_err6(dat text)
+returns text as $$
+    cluster 'testcluster';
+    cache cluster ttl 10;
+$$ language plproxy;
+
+create function test_cache_err7(dat text)
+returns text as $$
+    cluster 'testcluster';
+    cache key ttl 10;
+$$ language plproxy;
+
+-- timeout errors
+create function test_timeout_err1(dat text)
+returns text as $$
+    cluster 'testcluster';
+    timeout 0;
+$$ language plproxy;
+
+create function test_timeout_err2(dat text)
+returns text as $$
+    cluster 'testcluster';
+    timeout 10 min;
+$$ language plproxy;
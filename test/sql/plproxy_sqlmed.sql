@@ -96,6 +96,15 @@ alter server sqlmedcluster options
      add  partition_2 'dbname=test_part1 host=localhost');
 select * from sqlmed_test1();
 
+-- idle_timeout option
+alter server sqlmedcluster options (add idle_timeout '600');
+select * from sqlmed_test1();
+
+-- idle_timeout must be non-negative integer
+alter server sqlmedcluster options (set idle_timeout 'abc');
+alter server sqlmedcluster options (set idle_timeout '-1');
+alter server sqlmedcluster options (drop idle_timeout);
+
 -- switching betweem SQL/MED and compat mode
 
 create or replace function sqlmed_compat_test() returns setof text as $$
@@ -122,3 +131,18 @@ drop server testcluster cascade;
 -- back on testcluster again
 select * from sqlmed_compat_test();
 
+-- result size limits
+create server limitcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             max_result_rows '3');
+create user mapping for public server limitcluster;
+
+create or replace function sqlmed_limit_test(n int4) returns setof text as $$
+    cluster 'limitcluster';
+    run on 0;
+    select 'row' from generate_series(1, n);
+$$ language plproxy;
+
+select * from sqlmed_limit_test(3);
+select * from sqlmed_limit_test(4);
+
@@ -143,6 +143,18 @@ as $$ begin return; end; $$ language plpgsql;
 select * from test_types2('types', 4, (2, 'asd'), array[1,2,3]);
 select * from test_types2('types', NULL, NULL, NULL);
 
+-- test NULL arguments given as literals
+create function test_nullargs(a text, b int4, c int4) returns text
+as $$ cluster 'testcluster'; run on 0; $$ language plproxy;
+\c test_part
+create function test_nullargs(a text, b int4, c int4) returns text
+as $$ select coalesce($1, '-') || '/' || coalesce($2::text, '-') || '/' || coalesce($3::text, '-') $$ language sql;
+\c regression
+select test_nullargs('a', 1, 2);
+select test_nullargs(NULL, 1, NULL);
+select test_nullargs('a', NULL, 2);
+select test_nullargs(NULL, 3, NULL);
+
 -- test CONNECT
 create function test_connect1() returns text
 as $$ connect 'dbname=test_part'; select current_database(); $$ language plproxy;
@@ -158,6 +170,11 @@ create function test_connect3(connstr text) returns text
 as $$ connect text(connstr); select current_database(); $$ language plproxy;
 select * from test_connect3('dbname=test_part');
 
+-- test CONNECT strings sharing connection
+create function test_connect_pid(connstr text) returns int4
+as $$ connect connstr; select pg_backend_pid(); $$ language plproxy;
+select test_connect_pid('dbname=test_part') = test_connect_pid('  dbname = ''test_part''  ');
+
 -- test quoting function
 create type "RetWeird" as (
     "ColId" int4,
@@ -245,6 +262,183 @@ as $$
 $$ language plproxy;
 select * from test_simple(0);
 
+-- test result cache
+\c test_part
+create sequence test_cache_seq;
+create function test_cache(key text) returns int8
+as $$ begin return nextval('test_cache_seq'); end; $$ language plpgsql;
+create function test_cache_set(key text) returns setof int8
+as $$ begin
+    return next nextval('test_cache_seq');
+    return next nextval('test_cache_seq');
+end; $$ language plpgsql;
+\c regression
+create function test_cache(key text) returns int8
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache ttl 600;
+$$ language plproxy;
+select * from test_cache('a');
+select * from test_cache('a');
+select * from test_cache('b');
+select * from test_cache(null);
+select * from test_cache(null);
+create function test_cache_set(key text) returns setof int8
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache ttl 600;
+$$ language plproxy;
+select * from test_cache_set('a');
+select * from test_cache_set('a');
+
+-- test key cache
+\c test_part
+create function test_cache_get(id int4) returns text
+as $$ begin return 'remote-' || id || '-' || nextval('test_cache_seq'); end; $$ language plpgsql;
+create function test_cache_put(id int4, data text) returns int4
+as $$ begin return id; end; $$ language plpgsql;
+create function test_cache_drop(id int4) returns int4
+as $$ begin return id; end; $$ language plpgsql;
+\c regression
+create function test_cache_get(id int4) returns text
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache get object(id);
+$$ language plproxy;
+create function test_cache_put(id int4, data text) returns int4
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache set object(id) = 'local-' || data;
+$$ language plproxy;
+create function test_cache_drop(id int4) returns int4
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache invalidate object(id);
+$$ language plproxy;
+select * from test_cache_get(1);
+select * from test_cache_get(1);
+select * from test_cache_put(1, 'foo');
+select * from test_cache_get(1);
+select * from test_cache_drop(1);
+select * from test_cache_get(1);
+
+-- key cache with own lifetime
+\c test_part
+create function test_cache_get2(id int4) returns text
+as $$ begin return 'remote-' || id || '-' || nextval('test_cache_seq'); end; $$ language plpgsql;
+\c regression
+create function test_cache_get2(id int4) returns text
+as $$
+    cluster 'testcluster';
+    run on 0;
+    cache get object2(id);
+    cache key ttl 1;
+$$ language plproxy;
+select * from test_cache_get2(1);
+select * from test_cache_get2(1);
+select pg_sleep(1.5);
+select * from test_cache_get2(1);
+
+-- test resolver cache
+\c test_part
+create function test_cache_cluster(id int4) returns int4
+as $$ begin return id; end; $$ language plpgsql;
+\c regression
+create sequence test_resolve_seq;
+create function test_resolve_cluster(id int4) returns text
+as $$ begin perform nextval('test_resolve_seq'); return 'testcluster'; end; $$ language plpgsql;
+create function test_cache_cluster(id int4) returns int4
+as $$
+    cluster test_resolve_cluster(id);
+    cache cluster ttl 600;
+    run on 0;
+$$ language plproxy;
+select * from test_cache_cluster(1);
+select * from test_cache_cluster(1);
+select * from test_cache_cluster(2);
+select currval('test_resolve_seq');
+
+\c test_part
+create function test_cache_run(id int4) returns int4
+as $$ begin return id; end; $$ language plpgsql;
+\c regression
+create function test_resolve_hash(id int4) returns int4
+as $$ begin perform nextval('test_resolve_seq'); return 0; end; $$ language plpgsql;
+create function test_cache_run(id int4) returns int4
+as $$
+    cluster 'testcluster';
+    run on test_resolve_hash(id);
+    cache run ttl 600;
+$$ language plproxy;
+select * from test_cache_run(1);
+select * from test_cache_run(1);
+select * from test_cache_run(2);
+select currval('test_resolve_seq');
+
+-- test asynchronous calls
+\c test_part
+create function test_async(id int4) returns setof text
+as $$ begin return next 'a-' || id; return next 'b-' || id; end; $$ language plpgsql;
+create function test_async_connect(id int4) returns text
+as $$ begin return 'c-' || id; end; $$ language plpgsql;
+\c regression
+create function test_async(id int4) returns setof text
+as $$
+    cluster 'testcluster';
+    run on 0;
+$$ language plproxy;
+create function test_async_connect(id int4) returns text
+as $$
+    connect 'dbname=test_part';
+$$ language plproxy;
+begin;
+select plproxy_call_async('test_async(int4)', 1);
+select plproxy_call_async('test_async_connect(int4)', 2);
+select plproxy_wait(2);
+select plproxy_result_bytes(2) > 0;
+select * from plproxy_fetch(1);
+select * from plproxy_fetch(2);
+commit;
+select plproxy_wait(1);
+begin;
+select plproxy_call_async('test_async(int4)', 3);
+select * from test_async(4);
+select plproxy_last_result_bytes() > 0;
+select * from plproxy_fetch(3);
+-- function replaced while asynchronous call is in progress
+select plproxy_call_async('test_async(int4)', 5);
+create or replace function test_async(id int4) returns setof text
+as $$
+    cluster 'testcluster';
+    run on 0;
+    select 'x-' || id;
+$$ language plproxy;
+select * from test_async(6);
+select * from plproxy_fetch(4);
+commit;
+-- calls in progress cannot be left to prepared transaction
+begin;
+select plproxy_call_async('test_async(int4)', 7);
+prepare transaction 'plproxy_async';
+select plproxy_wait(5);
+
+-- statement keywords as argument names
+\c test_part
+create function test_keyword_args(timeout int4, cache text) returns text
+as $$ begin return cache || '-' || timeout; end; $$ language plpgsql;
+\c regression
+create function test_keyword_args(timeout int4, cache text) returns text
+as $$
+    cluster 'testcluster';
+    run on timeout;
+$$ language plproxy;
+select * from test_keyword_args(1, 'x');
+
 -- test error passing
 \c test_part
 create function test_error1() returns int4